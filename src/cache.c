@@ -0,0 +1,785 @@
+/*
+    cache.c: Token state cached by the driver
+    Copyright (C) 2012 Aktiv Co
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public License
+	along with this library; if not, write to the Free Software Foundation,
+	Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include <string.h>
+#include <stdlib.h>
+#include <pcsclite.h>
+#include <ifdhandler.h>
+
+#include "misc.h"
+#include "config.h"
+#include "rutokens.h"
+#include "defs.h"
+#include "readers.h"
+#include "debug.h"
+#include "utils.h"
+#include "apdu.h"
+#include "convert_apdu.h"
+#include "instructions.h"
+#include "cache.h"
+#include "commands.h"
+#include "parser.h"
+
+/* Biggest READ BINARY sent to read ahead */
+#define CACHE_READAHEAD_LE	0xFF
+
+/* ne need to initialize to 0 since it is static */
+static _token_cache TokenCache[DRIVER_MAX_READERS];
+
+/* DF/EF paths whose content may be cached, from Info.plist */
+static unsigned short ConfigPath[CACHE_MAX_CONFIG_PATHS][CACHE_MAX_PATH];
+static int ConfigPathLen[CACHE_MAX_CONFIG_PATHS];
+static int ConfigPaths = 0;
+
+/* internal functions */
+
+static void CacheForgetCurrentFile(_token_cache *cache);
+
+static void CacheForgetContent(_token_cache *cache);
+
+static int SelectTarget(const _token_cache *cache, const ifd_iso_apdu_t *iso,
+	unsigned short target[], int *target_len);
+
+static int ParsePath(const char value[], unsigned short path[]);
+
+static _ef_cache *EfFind(_token_cache *cache, int create);
+
+static int EfValid(const _ef_cache *ef, unsigned int offset,
+	unsigned int len);
+
+static void EfStore(_ef_cache *ef, unsigned int offset,
+	const unsigned char data[], unsigned int len);
+
+static void CacheReadAhead(unsigned int reader_index, _ef_cache *ef,
+	unsigned int offset, unsigned int len);
+
+static _get_data_cache *GetDataEntry(_token_cache *cache,
+	const ifd_iso_apdu_t *iso);
+
+static _do_info_cache *DoInfoFind(_token_cache *cache,
+	const ifd_iso_apdu_t *iso, int create);
+
+static void CacheForgetDoInfo(_token_cache *cache);
+
+
+/*****************************************************************************
+ *
+ *					SelectTarget
+ *
+ *  Compute the path of the file a SELECT FILE will make current.
+ *  return FALSE if it can't be known from the current state.
+ *
+ *  Rutoken S looks a file identifier up among the children of the
+ *  current DF (or the current file itself), so selecting by file
+ *  identifier from a known path gives a known path.
+ ****************************************************************************/
+static int SelectTarget(const _token_cache *cache, const ifd_iso_apdu_t *iso,
+	unsigned short target[], int *target_len)
+{
+	const unsigned char *data = iso->data;
+	int i, n, df_len;
+
+	/* only "first or only occurrence" with FCP returned */
+	if (iso->p2 != 0x00 || NULL == data || 0 == iso->lc
+		|| (iso->lc & 1) || iso->lc > iso->len)
+		return FALSE;
+
+	n = iso->lc / 2;
+
+	/* length of the path of the current DF */
+	df_len = cache->path_len;
+	if (df_len > 0 && !cache->is_df)
+		df_len--;
+
+	switch (iso->p1)
+	{
+		/* select by file identifier */
+		case 0x00:
+			if (n != 1)
+				return FALSE;
+			target[0] = (data[0] << 8) | data[1];
+			if (FID_MF == target[0])
+			{
+				*target_len = 1;
+				return TRUE;
+			}
+			if (0 == cache->path_len)
+				return FALSE;
+			memcpy(target, cache->path, cache->path_len * sizeof(target[0]));
+			*target_len = cache->path_len;
+			/* the current file itself */
+			if (((data[0] << 8) | data[1]) == cache->path[cache->path_len - 1])
+				return TRUE;
+			if (df_len >= CACHE_MAX_PATH)
+				return FALSE;
+			target[df_len] = (data[0] << 8) | data[1];
+			*target_len = df_len + 1;
+			return TRUE;
+
+		/* select parent DF */
+		case 0x03:
+			if (df_len < 2)
+				return FALSE;
+			memcpy(target, cache->path, (df_len - 1) * sizeof(target[0]));
+			*target_len = df_len - 1;
+			return TRUE;
+
+		/* select by path from MF */
+		case 0x08:
+			if (n + 1 > CACHE_MAX_PATH)
+				return FALSE;
+			target[0] = FID_MF;
+			for (i = 0; i < n; i++)
+				target[i + 1] = (data[2 * i] << 8) | data[2 * i + 1];
+			*target_len = n + 1;
+			return TRUE;
+
+		/* select by path from current DF */
+		case 0x09:
+			if (0 == df_len || df_len + n > CACHE_MAX_PATH)
+				return FALSE;
+			memcpy(target, cache->path, df_len * sizeof(target[0]));
+			for (i = 0; i < n; i++)
+				target[df_len + i] = (data[2 * i] << 8) | data[2 * i + 1];
+			*target_len = df_len + n;
+			return TRUE;
+
+		default:
+			return FALSE;
+	}
+} /* SelectTarget */
+
+
+/*****************************************************************************
+ *
+ *					GetDataEntry
+ *
+ *  return the cache entry of a get_serial or get_free_mem command or NULL
+ ****************************************************************************/
+static _get_data_cache *GetDataEntry(_token_cache *cache,
+	const ifd_iso_apdu_t *iso)
+{
+	if (iso->cse != IFD_APDU_CASE_2S)
+		return NULL;
+
+	if (0x81 == iso->p2)
+		return &cache->serial;
+	if (0x8a == iso->p2)
+		return &cache->free_mem;
+
+	return NULL;
+} /* GetDataEntry */
+
+
+/*****************************************************************************
+ *
+ *					DoInfoFind
+ *
+ *  return the cache entry of a get_do_info command or NULL
+ *  if create is TRUE an entry is reused if the command is not cached
+ ****************************************************************************/
+static _do_info_cache *DoInfoFind(_token_cache *cache,
+	const ifd_iso_apdu_t *iso, int create)
+{
+	_do_info_cache *entry, *victim = NULL;
+	int i;
+
+	if (iso->lc > CACHE_DO_INFO_KEY_SIZE || iso->lc > iso->len)
+		return NULL;
+
+	for (i = 0; i < CACHE_DO_INFO_ENTRIES; i++)
+	{
+		entry = &cache->do_info[i];
+		if (entry->len && entry->p1 == iso->p1 && entry->p2 == iso->p2
+			&& entry->key_len == iso->lc
+			&& 0 == memcmp(entry->key, iso->data, iso->lc))
+			return entry;
+
+		if (NULL == victim || 0 == entry->len
+			|| (victim->len && entry->stamp < victim->stamp))
+			victim = entry;
+	}
+
+	if (!create)
+		return NULL;
+
+	entry = victim;
+	entry->p1 = iso->p1;
+	entry->p2 = iso->p2;
+	if (iso->lc)
+		memcpy(entry->key, iso->data, iso->lc);
+	entry->key_len = iso->lc;
+	entry->len = 0;
+
+	return entry;
+} /* DoInfoFind */
+
+
+/*****************************************************************************
+ *
+ *					ParsePath
+ *
+ *  parse a "3F00/1000/1001" path
+ *  return the number of file identifiers or 0 if the path is invalid
+ ****************************************************************************/
+static int ParsePath(const char value[], unsigned short path[])
+{
+	const char *p = value;
+	char *end;
+	unsigned long fid;
+	int n = 0;
+
+	while (n < CACHE_MAX_PATH)
+	{
+		fid = strtoul(p, &end, 16);
+		if (end == p || fid > 0xFFFF)
+			return 0;
+		path[n++] = fid;
+
+		if ('\0' == *end)
+			return (FID_MF == path[0]) ? n : 0;
+		if (*end != '/')
+			return 0;
+		p = end + 1;
+	}
+
+	return 0;
+} /* ParsePath */
+
+
+/*****************************************************************************
+ *
+ *					EfFind
+ *
+ *  return the content cache entry of the current EF or NULL
+ *  if create is TRUE a new entry is used if the EF content may be cached
+ ****************************************************************************/
+static _ef_cache *EfFind(_token_cache *cache, int create)
+{
+	_ef_cache *ef, *victim = NULL;
+	const unsigned char *size;
+	int i, j;
+
+	if (0 == cache->path_len || cache->is_df)
+		return NULL;
+
+	for (i = 0; i < CACHE_EF_ENTRIES; i++)
+	{
+		ef = &cache->ef[i];
+		if (ef->path_len == cache->path_len
+			&& 0 == memcmp(ef->path, cache->path,
+				cache->path_len * sizeof(cache->path[0])))
+			return ef;
+
+		if (NULL == victim || 0 == ef->path_len
+			|| (victim->path_len && ef->stamp < victim->stamp))
+			victim = ef;
+	}
+
+	if (!create)
+		return NULL;
+
+	/* only the DF/EF enabled in Info.plist */
+	for (i = 0; i < ConfigPaths; i++)
+	{
+		if (ConfigPathLen[i] > cache->path_len)
+			continue;
+		for (j = 0; j < ConfigPathLen[i]; j++)
+			if (ConfigPath[i][j] != cache->path[j])
+				break;
+		if (j == ConfigPathLen[i])
+			break;
+	}
+	if (i == ConfigPaths)
+		return NULL;
+
+	size = fcp_find_tag(cache->fcp, cache->fcp_len - 2, FCP_TAG_FILE_SIZE, 2);
+	if (NULL == size || ((size[0] << 8) | size[1]) > CACHE_EF_MAX_SIZE)
+		return NULL;
+
+	ef = victim;
+	memcpy(ef->path, cache->path, cache->path_len * sizeof(cache->path[0]));
+	ef->path_len = cache->path_len;
+	ef->size = (size[0] << 8) | size[1];
+	ef->next_offset = 0;
+	memset(ef->valid, 0, sizeof(ef->valid));
+
+	return ef;
+} /* EfFind */
+
+
+/*****************************************************************************
+ *
+ *					EfValid
+ *
+ *  return TRUE if len bytes at offset are cached
+ ****************************************************************************/
+static int EfValid(const _ef_cache *ef, unsigned int offset,
+	unsigned int len)
+{
+	unsigned int i;
+
+	for (i = offset; i < offset + len; i++)
+		if (!(ef->valid[i / 8] & (1 << (i % 8))))
+			return FALSE;
+
+	return TRUE;
+} /* EfValid */
+
+
+/*****************************************************************************
+ *
+ *					EfStore
+ *
+ ****************************************************************************/
+static void EfStore(_ef_cache *ef, unsigned int offset,
+	const unsigned char data[], unsigned int len)
+{
+	unsigned int i;
+
+	if (offset >= ef->size)
+		return;
+	if (len > ef->size - offset)
+		len = ef->size - offset;
+
+	memcpy(ef->data + offset, data, len);
+	for (i = offset; i < offset + len; i++)
+		ef->valid[i / 8] |= 1 << (i % 8);
+} /* EfStore */
+
+
+/*****************************************************************************
+ *
+ *					CacheReadAhead
+ *
+ *  read more than asked when the EF is read sequentially
+ ****************************************************************************/
+static void CacheReadAhead(unsigned int reader_index, _ef_cache *ef,
+	unsigned int offset, unsigned int len)
+{
+	_token_cache *cache = &TokenCache[reader_index];
+	unsigned char cmd[5];
+	unsigned char resp[RESP_BUF_SIZE];
+	unsigned int resp_length = sizeof(resp);
+	unsigned int le;
+
+	le = min(CACHE_READAHEAD_LE, ef->size - offset);
+	if (le <= len)
+		return;
+
+	cmd[0] = 0x00;
+	cmd[1] = 0xb0;
+	cmd[2] = offset >> 8;
+	cmd[3] = offset & 0xFF;
+	cmd[4] = le;
+
+	DEBUG_COMM3("read ahead %u bytes at %u", le, offset);
+
+	/* the answer is stored by CacheUpdate() */
+	cache->readahead = TRUE;
+	(void)CmdXfrBlock(reader_index, sizeof(cmd), cmd, &resp_length, resp, T_0);
+	cache->readahead = FALSE;
+} /* CacheReadAhead */
+
+
+/*****************************************************************************
+ *
+ *					CacheForgetCurrentFile
+ *
+ ****************************************************************************/
+static void CacheForgetCurrentFile(_token_cache *cache)
+{
+	cache->path_len = 0;
+	cache->fcp_len = 0;
+} /* CacheForgetCurrentFile */
+
+
+/*****************************************************************************
+ *
+ *					CacheForgetContent
+ *
+ ****************************************************************************/
+static void CacheForgetContent(_token_cache *cache)
+{
+	int i;
+
+	for (i = 0; i < CACHE_EF_ENTRIES; i++)
+		cache->ef[i].path_len = 0;
+} /* CacheForgetContent */
+
+
+/*****************************************************************************
+ *
+ *					CacheForgetDoInfo
+ *
+ ****************************************************************************/
+static void CacheForgetDoInfo(_token_cache *cache)
+{
+	int i;
+
+	for (i = 0; i < CACHE_DO_INFO_ENTRIES; i++)
+		cache->do_info[i].len = 0;
+} /* CacheForgetDoInfo */
+
+
+/*****************************************************************************
+ *
+ *					CacheInit
+ *
+ *  read the DF/EF whose content may be cached from Info.plist
+ ****************************************************************************/
+void CacheInit(const char infofile[])
+{
+	char keyValue[TOKEN_MAX_VALUE_SIZE];
+	int i;
+
+	for (i = 0; ConfigPaths < CACHE_MAX_CONFIG_PATHS
+		&& 0 == LTPBundleFindValueWithKey(infofile, "ifdReadCachePath",
+			keyValue, i); i++)
+	{
+		ConfigPathLen[ConfigPaths] = ParsePath(keyValue,
+			ConfigPath[ConfigPaths]);
+		if (0 == ConfigPathLen[ConfigPaths])
+		{
+			DEBUG_CRITICAL2("Invalid ifdReadCachePath: %s", keyValue);
+			continue;
+		}
+
+		DEBUG_INFO2("READ BINARY cache enabled for %s", keyValue);
+		ConfigPaths++;
+	}
+} /* CacheInit */
+
+
+/*****************************************************************************
+ *
+ *					CacheReset
+ *
+ *  forget everything known about the token state
+ ****************************************************************************/
+void CacheReset(unsigned int reader_index)
+{
+	_token_cache *cache = &TokenCache[reader_index];
+
+	CacheForgetCurrentFile(cache);
+	CacheForgetContent(cache);
+	cache->serial.len = 0;
+	cache->free_mem.len = 0;
+	CacheForgetDoInfo(cache);
+} /* CacheReset */
+
+
+/*****************************************************************************
+ *
+ *					CacheLookup
+ *
+ *  return TRUE if the answer to the command has been found in the cache
+ ****************************************************************************/
+int CacheLookup(unsigned int reader_index, const _instruction *ins,
+	const ifd_iso_apdu_t *iso, unsigned char rx_buffer[],
+	unsigned int *rx_length)
+{
+	if (NULL == ins->lookup || !Readers[reader_index].tuning.cache)
+		return FALSE;
+
+	return ins->lookup(reader_index, iso, rx_buffer, rx_length);
+} /* CacheLookup */
+
+
+/*****************************************************************************
+ *
+ *					CacheUpdate
+ *
+ *  learn from the translated answer to a command sent to the token
+ *  rx_length is 0 if the command failed
+ ****************************************************************************/
+void CacheUpdate(unsigned int reader_index, const _instruction *ins,
+	const ifd_iso_apdu_t *iso, const unsigned char rx_buffer[],
+	unsigned int rx_length)
+{
+	_token_cache *cache = &TokenCache[reader_index];
+
+	/* the hook may need the current file */
+	if (ins->update)
+		ins->update(reader_index, iso, rx_buffer, rx_length);
+
+	if (ins->flags & INS_CHANGES_MEMORY)
+		cache->free_mem.len = 0;
+
+	if (ins->flags & INS_CHANGES_DO_INFO)
+		CacheForgetDoInfo(cache);
+
+	if (ins->flags & INS_CHANGES_CONTENT)
+		CacheForgetContent(cache);
+
+	/* the current file is not known anymore */
+	if (!(ins->flags & INS_KEEPS_CURRENT_FILE))
+		CacheForgetCurrentFile(cache);
+} /* CacheUpdate */
+
+
+/*****************************************************************************
+ *
+ *					CacheSelectLookup
+ *
+ *  SELECT FILE targeting the current file
+ ****************************************************************************/
+int CacheSelectLookup(unsigned int reader_index, const ifd_iso_apdu_t *iso,
+	unsigned char rx_buffer[], unsigned int *rx_length)
+{
+	_token_cache *cache = &TokenCache[reader_index];
+	unsigned short target[CACHE_MAX_PATH];
+	int target_len;
+
+	if (0 == cache->fcp_len || *rx_length < cache->fcp_len)
+		return FALSE;
+
+	if (!SelectTarget(cache, iso, target, &target_len)
+		|| target_len != cache->path_len
+		|| memcmp(target, cache->path, target_len * sizeof(target[0])))
+		return FALSE;
+
+	memcpy(rx_buffer, cache->fcp, cache->fcp_len);
+	*rx_length = cache->fcp_len;
+	DEBUG_COMM2("SELECT FILE %04X answered from cache",
+		cache->path[cache->path_len - 1]);
+	return TRUE;
+} /* CacheSelectLookup */
+
+
+/*****************************************************************************
+ *
+ *					CacheSelectUpdate
+ *
+ *  track the current file
+ ****************************************************************************/
+void CacheSelectUpdate(unsigned int reader_index, const ifd_iso_apdu_t *iso,
+	const unsigned char rx_buffer[], unsigned int rx_length)
+{
+	_token_cache *cache = &TokenCache[reader_index];
+	unsigned short target[CACHE_MAX_PATH];
+	const unsigned char *fid, *type;
+	int target_len;
+
+	if (rx_length >= 2
+		&& 0x90 == rx_buffer[rx_length - 2] && 0x00 == rx_buffer[rx_length - 1]
+		&& rx_length <= sizeof(cache->fcp)
+		&& SelectTarget(cache, iso, target, &target_len))
+	{
+		fid = fcp_find_tag(rx_buffer, rx_length - 2, FCP_TAG_FILE_ID, 2);
+		type = fcp_find_tag(rx_buffer, rx_length - 2, FCP_TAG_FILE_TYPE, 2);
+
+		/* the token must agree with us */
+		if (fid && type
+			&& ((fid[0] << 8) | fid[1]) == target[target_len - 1])
+		{
+			memcpy(cache->path, target, target_len * sizeof(target[0]));
+			cache->path_len = target_len;
+			cache->is_df = (FILE_TYPE_DF == type[0]);
+			memcpy(cache->fcp, rx_buffer, rx_length);
+			cache->fcp_len = rx_length;
+			return;
+		}
+	}
+
+	/* the current file is not known anymore */
+	CacheForgetCurrentFile(cache);
+} /* CacheSelectUpdate */
+
+
+/*****************************************************************************
+ *
+ *					CacheReadBinaryLookup
+ *
+ *  READ BINARY of a cached EF
+ ****************************************************************************/
+int CacheReadBinaryLookup(unsigned int reader_index, const ifd_iso_apdu_t *iso,
+	unsigned char rx_buffer[], unsigned int *rx_length)
+{
+	_token_cache *cache = &TokenCache[reader_index];
+	_ef_cache *ef = EfFind(cache, FALSE);
+	unsigned int offset = (iso->p1 << 8) | iso->p2;
+	unsigned int len = iso->le;
+
+	if (NULL == ef || iso->cse != IFD_APDU_CASE_2S
+		|| offset + len > ef->size || *rx_length < len + 2)
+		return FALSE;
+
+	if (!EfValid(ef, offset, len) && !cache->readahead
+		&& offset > 0 && offset == ef->next_offset)
+		CacheReadAhead(reader_index, ef, offset, len);
+
+	if (!EfValid(ef, offset, len))
+		return FALSE;
+
+	memcpy(rx_buffer, ef->data + offset, len);
+	rx_buffer[len] = 0x90;
+	rx_buffer[len + 1] = 0x00;
+	*rx_length = len + 2;
+	ef->next_offset = offset + len;
+	ef->stamp = ++cache->ef_stamp;
+	DEBUG_COMM3("READ BINARY %u bytes at %u answered from cache", len,
+		offset);
+	return TRUE;
+} /* CacheReadBinaryLookup */
+
+
+/*****************************************************************************
+ *
+ *					CacheReadBinaryUpdate
+ *
+ ****************************************************************************/
+void CacheReadBinaryUpdate(unsigned int reader_index, const ifd_iso_apdu_t *iso,
+	const unsigned char rx_buffer[], unsigned int rx_length)
+{
+	_token_cache *cache = &TokenCache[reader_index];
+	unsigned int offset = (iso->p1 << 8) | iso->p2;
+	_ef_cache *ef;
+
+	if (rx_length > 2
+		&& 0x90 == rx_buffer[rx_length - 2] && 0x00 == rx_buffer[rx_length - 1]
+		&& NULL != (ef = EfFind(cache, TRUE)))
+	{
+		EfStore(ef, offset, rx_buffer, rx_length - 2);
+		ef->next_offset = offset + rx_length - 2;
+		ef->stamp = ++cache->ef_stamp;
+	}
+} /* CacheReadBinaryUpdate */
+
+
+/*****************************************************************************
+ *
+ *					CacheWriteBinaryUpdate
+ *
+ *  UPDATE BINARY, WRITE BINARY, ERASE BINARY of the current EF
+ ****************************************************************************/
+void CacheWriteBinaryUpdate(unsigned int reader_index, const ifd_iso_apdu_t *iso,
+	const unsigned char rx_buffer[], unsigned int rx_length)
+{
+	_token_cache *cache = &TokenCache[reader_index];
+	_ef_cache *ef = EfFind(cache, FALSE);
+
+	(void)iso;
+	(void)rx_buffer;
+	(void)rx_length;
+
+	if (ef)
+		ef->path_len = 0;
+	/* we may not know which EF is written */
+	else if (0 == cache->path_len)
+		CacheForgetContent(cache);
+} /* CacheWriteBinaryUpdate */
+
+
+/*****************************************************************************
+ *
+ *					CacheGetDataLookup
+ *
+ *  get_serial, get_free_mem
+ ****************************************************************************/
+int CacheGetDataLookup(unsigned int reader_index, const ifd_iso_apdu_t *iso,
+	unsigned char rx_buffer[], unsigned int *rx_length)
+{
+	_get_data_cache *entry = GetDataEntry(&TokenCache[reader_index], iso);
+
+	if (NULL == entry || 0 == entry->len || entry->le != iso->le
+		|| *rx_length < entry->len)
+		return FALSE;
+
+	memcpy(rx_buffer, entry->data, entry->len);
+	*rx_length = entry->len;
+	DEBUG_COMM2("GET DATA %02X answered from cache", iso->p2);
+	return TRUE;
+} /* CacheGetDataLookup */
+
+
+/*****************************************************************************
+ *
+ *					CacheGetDataUpdate
+ *
+ ****************************************************************************/
+void CacheGetDataUpdate(unsigned int reader_index, const ifd_iso_apdu_t *iso,
+	const unsigned char rx_buffer[], unsigned int rx_length)
+{
+	_get_data_cache *entry = GetDataEntry(&TokenCache[reader_index], iso);
+
+	if (NULL == entry)
+		return;
+
+	entry->len = 0;
+	if (rx_length >= 2 && rx_length <= sizeof(entry->data)
+		&& 0x90 == rx_buffer[rx_length - 2]
+		&& 0x00 == rx_buffer[rx_length - 1])
+	{
+		memcpy(entry->data, rx_buffer, rx_length);
+		entry->len = rx_length;
+		entry->le = iso->le;
+	}
+} /* CacheGetDataUpdate */
+
+
+/*****************************************************************************
+ *
+ *					CacheDoInfoLookup
+ *
+ *  get_do_info
+ ****************************************************************************/
+int CacheDoInfoLookup(unsigned int reader_index, const ifd_iso_apdu_t *iso,
+	unsigned char rx_buffer[], unsigned int *rx_length)
+{
+	_token_cache *cache = &TokenCache[reader_index];
+	_do_info_cache *do_info = DoInfoFind(cache, iso, FALSE);
+
+	if (NULL == do_info || *rx_length < do_info->len)
+		return FALSE;
+
+	memcpy(rx_buffer, do_info->data, do_info->len);
+	*rx_length = do_info->len;
+	do_info->stamp = ++cache->do_info_stamp;
+	DEBUG_COMM3("get_do_info %02X %02X answered from cache", iso->p1,
+		iso->p2);
+	return TRUE;
+} /* CacheDoInfoLookup */
+
+
+/*****************************************************************************
+ *
+ *					CacheDoInfoUpdate
+ *
+ *  a missing DO is remembered too
+ ****************************************************************************/
+void CacheDoInfoUpdate(unsigned int reader_index, const ifd_iso_apdu_t *iso,
+	const unsigned char rx_buffer[], unsigned int rx_length)
+{
+	_token_cache *cache = &TokenCache[reader_index];
+	_do_info_cache *do_info;
+
+	if (rx_length >= 2 && rx_length <= CACHE_DO_INFO_SIZE
+		&& ((0x90 == rx_buffer[rx_length - 2]
+				&& 0x00 == rx_buffer[rx_length - 1])
+			|| (0x6a == rx_buffer[rx_length - 2]
+				&& 0x82 == rx_buffer[rx_length - 1]))
+		&& NULL != (do_info = DoInfoFind(cache, iso, TRUE)))
+	{
+		memcpy(do_info->data, rx_buffer, rx_length);
+		do_info->len = rx_length;
+		do_info->stamp = ++cache->do_info_stamp;
+	}
+} /* CacheDoInfoUpdate */
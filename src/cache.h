@@ -0,0 +1,198 @@
+/*
+    cache.h: Token state cached by the driver
+    Copyright (C) 2012 Aktiv Co
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public License
+	along with this library; if not, write to the Free Software Foundation,
+	Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#ifndef CACHE_H
+#define CACHE_H
+
+/* Maximum depth of the tracked file path (MF included) */
+#define CACHE_MAX_PATH	8
+
+/* Size of the cached SELECT FILE answer (FCP + SW) */
+#define CACHE_FCP_SIZE	(63+2)
+
+/* Number of EF whose content is cached per reader */
+#define CACHE_EF_ENTRIES	4
+
+/* Biggest EF whose content is cached */
+#define CACHE_EF_MAX_SIZE	4096
+
+/* Number of DF/EF paths enabled in Info.plist */
+#define CACHE_MAX_CONFIG_PATHS	16
+
+/* Size of a cached GET DATA answer (data + SW) */
+#define CACHE_GET_DATA_SIZE	(32+2)
+
+/* Number of get_do_info answers cached per reader */
+#define CACHE_DO_INFO_ENTRIES	16
+
+/* Biggest get_do_info command data used as a key */
+#define CACHE_DO_INFO_KEY_SIZE	8
+
+/* Size of a cached get_do_info answer (DO info + SW) */
+#define CACHE_DO_INFO_SIZE	(0xFF+2)
+
+typedef struct
+{
+	/*
+	 * Le of the command, len is 0 if the answer is not known
+	 */
+	unsigned int le;
+	unsigned int len;
+	unsigned char data[CACHE_GET_DATA_SIZE];
+} _get_data_cache;
+
+typedef struct
+{
+	/*
+	 * P1, P2 and data of the command
+	 */
+	unsigned char p1, p2;
+	unsigned char key[CACHE_DO_INFO_KEY_SIZE];
+	unsigned int key_len;
+
+	/*
+	 * Least recently used entry is reused first
+	 */
+	unsigned long stamp;
+
+	/*
+	 * Translated answer, len is 0 if the entry is unused
+	 */
+	unsigned int len;
+	unsigned char data[CACHE_DO_INFO_SIZE];
+} _do_info_cache;
+
+typedef struct
+{
+	/*
+	 * EF path from the MF, path_len is 0 if the entry is unused
+	 */
+	unsigned short path[CACHE_MAX_PATH];
+	int path_len;
+
+	/*
+	 * EF size from its FCP
+	 */
+	unsigned int size;
+
+	/*
+	 * Offset following the last READ BINARY, to detect sequential reads
+	 */
+	unsigned int next_offset;
+
+	/*
+	 * Least recently used entry is reused first
+	 */
+	unsigned long stamp;
+
+	unsigned char data[CACHE_EF_MAX_SIZE];
+	unsigned char valid[CACHE_EF_MAX_SIZE / 8];
+} _ef_cache;
+
+typedef struct
+{
+	/*
+	 * Current file path from the MF
+	 * path_len is 0 if the current file is not known
+	 */
+	unsigned short path[CACHE_MAX_PATH];
+	int path_len;
+
+	/*
+	 * Current file is a DF
+	 */
+	int is_df;
+
+	/*
+	 * Translated SELECT FILE answer of the current file
+	 */
+	unsigned char fcp[CACHE_FCP_SIZE];
+	unsigned int fcp_len;
+
+	/*
+	 * READ BINARY content of the EF enabled in Info.plist
+	 */
+	_ef_cache ef[CACHE_EF_ENTRIES];
+	unsigned long ef_stamp;
+
+	/*
+	 * get_serial answer, valid for the whole power session
+	 */
+	_get_data_cache serial;
+
+	/*
+	 * get_free_mem answer, valid until the token memory is changed
+	 */
+	_get_data_cache free_mem;
+
+	/*
+	 * get_do_info answers, valid until a DO is created or changed
+	 */
+	_do_info_cache do_info[CACHE_DO_INFO_ENTRIES];
+	unsigned long do_info_stamp;
+
+	/*
+	 * A read ahead is in progress
+	 */
+	int readahead;
+} _token_cache;
+
+void CacheInit(const char infofile[]);
+
+void CacheReset(unsigned int reader_index);
+
+int CacheLookup(unsigned int reader_index, const _instruction *ins,
+	const ifd_iso_apdu_t *iso, unsigned char rx_buffer[],
+	unsigned int *rx_length);
+
+void CacheUpdate(unsigned int reader_index, const _instruction *ins,
+	const ifd_iso_apdu_t *iso, const unsigned char rx_buffer[],
+	unsigned int rx_length);
+
+/* _instruction hooks */
+
+int CacheSelectLookup(unsigned int reader_index, const ifd_iso_apdu_t *iso,
+	unsigned char rx_buffer[], unsigned int *rx_length);
+
+void CacheSelectUpdate(unsigned int reader_index, const ifd_iso_apdu_t *iso,
+	const unsigned char rx_buffer[], unsigned int rx_length);
+
+int CacheReadBinaryLookup(unsigned int reader_index, const ifd_iso_apdu_t *iso,
+	unsigned char rx_buffer[], unsigned int *rx_length);
+
+void CacheReadBinaryUpdate(unsigned int reader_index, const ifd_iso_apdu_t *iso,
+	const unsigned char rx_buffer[], unsigned int rx_length);
+
+void CacheWriteBinaryUpdate(unsigned int reader_index, const ifd_iso_apdu_t *iso,
+	const unsigned char rx_buffer[], unsigned int rx_length);
+
+int CacheGetDataLookup(unsigned int reader_index, const ifd_iso_apdu_t *iso,
+	unsigned char rx_buffer[], unsigned int *rx_length);
+
+void CacheGetDataUpdate(unsigned int reader_index, const ifd_iso_apdu_t *iso,
+	const unsigned char rx_buffer[], unsigned int rx_length);
+
+int CacheDoInfoLookup(unsigned int reader_index, const ifd_iso_apdu_t *iso,
+	unsigned char rx_buffer[], unsigned int *rx_length);
+
+void CacheDoInfoUpdate(unsigned int reader_index, const ifd_iso_apdu_t *iso,
+	const unsigned char rx_buffer[], unsigned int rx_length);
+
+#endif
@@ -35,10 +35,19 @@
 #include "rutokens.h"
 #include "defs.h"
 #include "config.h"
+#include "readers.h"
 #include "debug.h"
+#include "utils.h"
 #include "rutokens_usb.h"
 #include "apdu.h"
 #include "convert_apdu.h"
+#include "instructions.h"
+#include "cache.h"
+#include "stats.h"
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 #define ICC_STATUS_IDLE			0x00
 #define ICC_STATUS_READY_DATA	0x10
@@ -57,8 +66,20 @@
 #define max( a, b )   ( ( ( a ) > ( b ) ) ? ( a ) : ( b ) )
 #define offsetof(TYPE, MEMBER) ((size_t) &((TYPE *)0)->MEMBER)
 
+#ifdef HAVE_PTHREAD
+/* a cancel must not hit the end of a command and abort the next one */
+static pthread_mutex_t CancelMutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
 /* internal functions */
 
+static int CmdCancelled(unsigned int reader_index);
+
+static void CmdResync(unsigned int reader_index);
+
+static void CmdPresenceSeen(unsigned int reader_index, int r,
+	unsigned char status);
+
 RESPONSECODE CmdGetSlotStatus(unsigned int reader_index, unsigned char* status);
 
 RESPONSECODE CmdTransmit(unsigned int reader_index, unsigned int tx_length, const unsigned char tx_buffer[]);
@@ -67,14 +88,15 @@ RESPONSECODE CmdReceive(unsigned int reader_index, unsigned int *rx_length, unsi
 
 RESPONSECODE CmdReceiveSW(unsigned int reader_index, unsigned char sw[]);
 
-RESPONSECODE CmdTranslateTxBuffer(const ifd_iso_apdu_t* iso, unsigned int *tx_length, unsigned char tx_buffer[], unsigned char** send_buf_trn);
+RESPONSECODE CmdTranslateTxBuffer(const _instruction* ins, const ifd_iso_apdu_t* iso, ifd_iso_apdu_t* tpdu, unsigned char scratch[]);
 
-RESPONSECODE CmdTranslateRxBuffer(const ifd_iso_apdu_t* iso, unsigned int *rx_length, unsigned char rx_buffer[], int rrecv);
+RESPONSECODE CmdTranslateRxBuffer(const _instruction* ins, unsigned int *rx_length, unsigned char rx_buffer[], int rrecv);
 
-RESPONSECODE CmdPrepareT0Hdr(ifd_iso_apdu_t* iso, unsigned char hdr[]);
+int CmdPrepareT0Hdr(const ifd_iso_apdu_t* iso, const _instruction* ins, unsigned char hdr[]);
 
-RESPONSECODE CmdSendTPDU(unsigned int reader_index, const void *sbuf,
-		size_t slen, void *rbuf, size_t rlen, int *rrecv, int iscase4);
+RESPONSECODE CmdSendTPDU(unsigned int reader_index, const ifd_iso_apdu_t *iso,
+		const _instruction *ins, void *rbuf, size_t rlen, int *rrecv,
+		int iscase4);
 
 
 /*****************************************************************************
@@ -123,6 +145,9 @@ RESPONSECODE CmdPowerOff(unsigned int reader_index)
 	_device_descriptor *device_descriptor = get_device_descriptor(reader_index);
 	int r;
 
+	/* the token state is lost */
+	CacheReset(reader_index);
+
 	r = ControlUSB(reader_index, 0x41, USB_ICC_POWER_OFF, 0, NULL, 0);
 	/* we got an error? */
 	if (r < 0)
@@ -146,6 +171,7 @@ RESPONSECODE CmdGetSlotStatus(unsigned int reader_index, unsigned char* status)
 	int r;
 
 	r = ControlUSB(reader_index, 0xC1, USB_ICC_GET_STATUS, 0, status, sizeof(*status));
+	CmdPresenceSeen(reader_index, r, *status);
 	/* we got an error? */
 	if (r < 0)
 	{
@@ -157,35 +183,175 @@ RESPONSECODE CmdGetSlotStatus(unsigned int reader_index, unsigned char* status)
 
 	if ((*status & 0xF0) == ICC_STATUS_BUSY_COMMON)
 	{
-		int i;
+		unsigned int stalls = 0, steps = 0;
+		unsigned long long start = GetTimeMs();
 		unsigned char prev_status;
 		DEBUG_COMM2("Busy: 0x%02X", *status);
-		for (i = 0; i < 200; i++)
+
+		/* the low nibble is a counter moving while the token works: wait
+		 * as long as it moves, give up when it stalls */
+		do
 		{
-			do
+			usleep(Readers[reader_index].tuning.busyInterval * 1000);
+			prev_status = *status;
+
+			r = ControlUSB(reader_index, 0xC1, USB_ICC_GET_STATUS, 0, status, sizeof(*status));
+			CmdPresenceSeen(reader_index, r, *status);
+			Readers[reader_index].stats.busyPolls++;
+			/* we got an error? */
+			if (r < 0)
+				break;
+
+			if ((*status & 0xF0) != ICC_STATUS_BUSY_COMMON)
+				break;
+
+			if ((*status & 0x0F) != (prev_status & 0x0F))
 			{
-				usleep(10000);  /* 10 ms */
-				prev_status = *status;
+				steps++;
+				stalls = 0;
+			}
+			else
+				stalls++;
+		} while (stalls < device_descriptor->busyBudget
+			&& !CmdCancelled(reader_index));
 
-				r = ControlUSB(reader_index, 0xC1, USB_ICC_GET_STATUS, 0, status, sizeof(*status));
-				/* we got an error? */
-				if (r < 0)
-				{
-					DEBUG_INFO2("ICC Slot Status failed: %s", strerror(errno));
-					if (ENODEV == errno)
-						return IFD_NO_SUCH_DEVICE;
-					return IFD_COMMUNICATION_ERROR;
-				}
+		device_descriptor->busyProgress = steps;
+		device_descriptor->busyTime = GetTimeMs() - start;
+		Readers[reader_index].stats.busyTime += device_descriptor->busyTime;
+		DEBUG_COMM3("Busy for %u ms, %u steps", device_descriptor->busyTime,
+			device_descriptor->busyProgress);
 
-				if ((*status & 0xF0) != ICC_STATUS_BUSY_COMMON)
-					return IFD_SUCCESS;
-			} while ((((prev_status & 0x0F) + 1) & 0x0F) == (*status & 0x0F));
+		if (r < 0)
+		{
+			DEBUG_INFO2("ICC Slot Status failed: %s", strerror(errno));
+			if (ENODEV == errno)
+				return IFD_NO_SUCH_DEVICE;
+			return IFD_COMMUNICATION_ERROR;
+		}
+
+		if ((*status & 0xF0) == ICC_STATUS_BUSY_COMMON)
+		{
+			if (!device_descriptor->cancelled)
+				DEBUG_CRITICAL2("Token stalled: 0x%02X", *status);
+			return IFD_COMMUNICATION_ERROR;
 		}
-		return IFD_COMMUNICATION_ERROR;
 	}
 	return IFD_SUCCESS;
 } /* CmdGetSlotStatus */
 
+/*****************************************************************************
+ *
+ *					CmdCancel
+ *
+ *  abort the command exchanged with the token, if any
+ *  may be called from any thread
+ *  return TRUE if a command was in flight
+ ****************************************************************************/
+int CmdCancel(unsigned int reader_index)
+{
+	_device_descriptor *device_descriptor = get_device_descriptor(reader_index);
+	int inFlight;
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&CancelMutex);
+#endif
+	inFlight = device_descriptor->inFlight;
+	if (inFlight)
+		device_descriptor->cancelled = TRUE;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&CancelMutex);
+#endif
+
+	return inFlight;
+} /* CmdCancel */
+
+
+/*****************************************************************************
+ *
+ *					CmdCancelled
+ *
+ ****************************************************************************/
+static int CmdCancelled(unsigned int reader_index)
+{
+	if (!get_device_descriptor(reader_index)->cancelled)
+		return FALSE;
+
+	DEBUG_INFO("Command cancelled");
+
+	return TRUE;
+} /* CmdCancelled */
+
+
+/*****************************************************************************
+ *
+ *					CmdResync
+ *
+ *  bring the token back to a known state after an aborted command
+ *  the security state of the token is lost
+ ****************************************************************************/
+static void CmdResync(unsigned int reader_index)
+{
+	unsigned char atr[RUTOKEN_ATR_LEN];
+	unsigned int atr_len;
+
+	DEBUG_INFO("Power cycle after an aborted command");
+	if (CmdPowerOn(reader_index, &atr_len, atr) != IFD_SUCCESS)
+		DEBUG_CRITICAL("Resync failed");
+
+	/* the applications must see a reset card, see IFDHICCPresence() */
+	Readers[reader_index].slot.bPowerFlags |= MASK_POWERFLAGS_RESYNC;
+	WakeUSB(reader_index);
+} /* CmdResync */
+
+
+/*****************************************************************************
+ *
+ *					CmdPresenceSeen
+ *
+ *  keep the presence told by a status read for CmdIccPresenceShadow()
+ ****************************************************************************/
+static void CmdPresenceSeen(unsigned int reader_index, int r,
+	unsigned char status)
+{
+	_device_descriptor *device_descriptor = get_device_descriptor(reader_index);
+
+	/* an error tells nothing, the next presence will ask the token */
+	if (r < 0)
+	{
+		device_descriptor->presenceTime = 0;
+		return;
+	}
+
+	device_descriptor->presence = (ICC_STATUS_MUTE == status)
+		? DEV_ICC_ABSENT : DEV_ICC_PRESENT_ACTIVE;
+	device_descriptor->presenceTime = GetTimeMs();
+} /* CmdPresenceSeen */
+
+
+/*****************************************************************************
+ *
+ *					CmdIccPresenceShadow
+ *
+ *  presence of the token from its last status read, no USB transfer
+ *  return FALSE if that status is older than ttl ms and no command is in
+ *  flight: the presence must be read with CmdIccPresence()
+ ****************************************************************************/
+int CmdIccPresenceShadow(unsigned int reader_index, unsigned int ttl,
+	unsigned char *presence)
+{
+	_device_descriptor *device_descriptor = get_device_descriptor(reader_index);
+	unsigned long long presenceTime = device_descriptor->presenceTime;
+
+	if (!device_descriptor->inFlight
+		&& (0 == presenceTime || GetTimeMs() >= presenceTime + ttl))
+		return FALSE;
+
+	*presence = device_descriptor->presence;
+
+	return TRUE;
+} /* CmdIccPresenceShadow */
+
+
 /*****************************************************************************
  *
  *					CmdIccPresence
@@ -216,48 +382,30 @@ RESPONSECODE CmdIccPresence(unsigned int reader_index,
  *
  *					CmdTranslateTxBuffer
  *
+ *  tpdu is a copy of iso. Its data is translated in scratch only if the
+ *  token expects other bytes, otherwise it still points to the command.
  ****************************************************************************/
-RESPONSECODE CmdTranslateTxBuffer(const ifd_iso_apdu_t* iso, unsigned int* tx_length, unsigned char tx_buffer[], unsigned char** send_buf_trn)
+RESPONSECODE CmdTranslateTxBuffer(const _instruction* ins, const ifd_iso_apdu_t* iso, ifd_iso_apdu_t* tpdu, unsigned char scratch[])
 {
 	int len;
-	*send_buf_trn = NULL;
 
-	if (iso->cla == 0 && *tx_length > 5)
+	if (NULL == ins->tx || 0 == iso->lc)
+		return IFD_SUCCESS;
+
+	/* scratch is CMD_BUF_SIZE bytes long */
+	if (iso->lc > CMD_BUF_SIZE)
 	{
-		*send_buf_trn = malloc(*tx_length);
-		if (!send_buf_trn)
-		{
-			DEBUG_INFO2("out of memory (tx_length = %u)", *tx_length);
-			return IFD_COMMUNICATION_ERROR;
-		}
-		memcpy(*send_buf_trn, tx_buffer, *tx_length);
-		/* select file, delete file */
-		if (iso->ins == 0xa4 || iso->ins == 0xe4)
-			swap_pair(*send_buf_trn + 5, *tx_length - 5);
-		/* create file */
-		else if (iso->ins == 0xe0)
-		{
-			len = convert_fcp_to_rtprot(*send_buf_trn + 5, *tx_length - 5);
-			DEBUG_COMM2("convert_fcp_to_rtprot = %i", len);
-			if (len > 0)
-			{
-				*tx_length = len + 5;
-				(*send_buf_trn)[4] = len; /* replace le */
-			}
-		}
-		/* create_do, key_gen */
-		else if (iso->ins == 0xda && iso->p1 == 1	&& (iso->p2 == 0x65 || iso->p2 == 0x62))
-		{
-			len = convert_doinfo_to_rtprot(*send_buf_trn + 5, *tx_length - 5);
-			DEBUG_COMM2("convert_doinfo_to_rtprot = %i", len);
-			if (len > 0)
-			{
-				*tx_length = len + 5;
-				(*send_buf_trn)[4] = len; /* replace le */
-			}
-		}
-		DEBUG_COMM2("le = %u", (*send_buf_trn)[4]);
+		DEBUG_INFO2("command too long (lc = %u)", iso->lc);
+		return IFD_COMMUNICATION_ERROR;
 	}
+	memcpy(scratch, iso->data, iso->lc);
+	tpdu->data = scratch;
+
+	len = ins->tx(scratch, iso->lc);
+	if (len > 0)
+		tpdu->lc = tpdu->len = len; /* replace lc */
+	DEBUG_COMM2("lc = %u", tpdu->lc);
+
 	return IFD_SUCCESS;
 }/* CmdTranslateTxBuffer */
 
@@ -267,7 +415,7 @@ RESPONSECODE CmdTranslateTxBuffer(const ifd_iso_apdu_t* iso, unsigned int* tx_le
  *					CmdTranslateRxBuffer
  *
  ****************************************************************************/
-RESPONSECODE CmdTranslateRxBuffer(const ifd_iso_apdu_t* iso, unsigned int *rx_length, unsigned char rx_buffer[], int rrecv)
+RESPONSECODE CmdTranslateRxBuffer(const _instruction* ins, unsigned int *rx_length, unsigned char rx_buffer[], int rrecv)
 {
 	int len;
 	unsigned char sw[2];
@@ -275,14 +423,12 @@ RESPONSECODE CmdTranslateRxBuffer(const ifd_iso_apdu_t* iso, unsigned int *rx_le
 	if (rrecv > 0 && (size_t)rrecv >= sizeof(sw))
 	{
 		memcpy(sw, (unsigned char*)rx_buffer + rrecv - sizeof(sw), sizeof(sw));
-		if (sw[0] != 0x90 || sw[1] != 0)
+		if (sw[0] != 0x90 || sw[1] != 0 || NULL == ins->rx)
 			/* do nothing */;
-		/* select file */
-		else if (iso->cla == 0 && iso->ins == 0xa4 && rrecv == sizeof(sw) + 32 /* size rtprot */)
+		else
 		{
-			len = convert_rtprot_to_fcp(rx_buffer, *rx_length);
-			DEBUG_COMM2("convert_rtprot_to_fcp = %i", len);
-			if (len > 0)
+			len = ins->rx(rx_buffer, rrecv - sizeof(sw), *rx_length);
+			if (len >= 0)
 			{
 				rrecv = -1;
 				if (*rx_length >= len + sizeof(sw))
@@ -292,37 +438,14 @@ RESPONSECODE CmdTranslateRxBuffer(const ifd_iso_apdu_t* iso, unsigned int *rx_le
 				}
 			}
 		}
-		/* get_do_info */
-		else if (iso->cla == 0x80 && iso->ins == 0x30	&& (size_t)rrecv >= sizeof(sw) + 32 /* size rtprot */)
-		{
-			len = convert_rtprot_to_doinfo(rx_buffer, *rx_length);
-			DEBUG_COMM2("convert_rtprot_to_doinfo = %i", len);
-			if (len > 0)
-			{
-				rrecv = -1;
-				if (*rx_length >= len + sizeof(sw))
-				{
-					memcpy((unsigned char*)rx_buffer+len, sw, sizeof(sw));
-					rrecv = len + sizeof(sw);
-				}
-			}
-		}
-		else if (iso->cla == 0 && iso->ins == 0xca && iso->p1 == 1)
-		{
-			/* get_serial, get_free_mem */
-			if (iso->p2 == 0x81 || iso->p2 == 0x8a)
-				swap_four(rx_buffer, rrecv - sizeof(sw));
-			/* get_current_ef */
-			else if (iso->p2 == 0x11)
-				swap_pair(rx_buffer, rrecv - sizeof(sw));
-		}
-		*rx_length = rrecv;
 	}
-	else
+
+	if (rrecv < (int)sizeof(sw))
 	{
 		*rx_length = 0;
 		return IFD_COMMUNICATION_ERROR;
 	}
+	*rx_length = rrecv;
 
 	return IFD_SUCCESS;
 }/* CmdTranslateRxBuffer */
@@ -336,6 +459,23 @@ RESPONSECODE CmdTranslateRxBuffer(const ifd_iso_apdu_t* iso, unsigned int *rx_le
 RESPONSECODE CmdXfrBlock(unsigned int reader_index, unsigned int tx_length,
 	unsigned char tx_buffer[], unsigned int *rx_length,
 	unsigned char rx_buffer[], int protocol) /* RT remove protocol: we use T0 only */
+{
+	return CmdXfrBlockTranslated(reader_index, tx_length, tx_buffer, NULL, 0,
+		rx_length, rx_buffer, protocol);
+} /* CmdXfrBlock */
+
+
+/*****************************************************************************
+ *
+ *					CmdXfrBlockTranslated
+ *
+ *  tx_data is the command data already translated for the token, or
+ *  NULL to translate the data of tx_buffer
+ ****************************************************************************/
+RESPONSECODE CmdXfrBlockTranslated(unsigned int reader_index,
+	unsigned int tx_length, unsigned char tx_buffer[],
+	unsigned char tx_data[], unsigned int tx_lc, unsigned int *rx_length,
+	unsigned char rx_buffer[], int protocol)
 {
 	RESPONSECODE return_value = IFD_SUCCESS;
 	_device_descriptor *device_descriptor = get_device_descriptor(reader_index);
@@ -346,54 +486,125 @@ RESPONSECODE CmdXfrBlock(unsigned int reader_index, unsigned int tx_length,
 		return IFD_PROTOCOL_NOT_SUPPORTED;
 	}
 
-	unsigned char *send_buf_trn = NULL;
-	const void *send_buf = tx_buffer;
 	int r, rrecv = -1, iscase4 = 0;
-	ifd_iso_apdu_t iso;
+	ifd_iso_apdu_t iso, tpdu;
+	const _instruction *ins;
+	const _instruction_profile *profile;
+	_reader_tuning *tuning = &Readers[reader_index].tuning;
+	_reader_stats *stats = &Readers[reader_index].stats;
+	unsigned long long start;
+	unsigned int transfers;
+	int cancelled;
 
 	DEBUG_COMM3("buffer %s; *rx_length = %d", array_hexdump(tx_buffer, tx_length), *rx_length);
 
+	/* the only parsing of the command, the data stay in tx_buffer */
 	if ( ifd_iso_apdu_parse(tx_buffer, tx_length, &iso) < 0)
 		return IFD_COMMUNICATION_ERROR;
 	DEBUG_COMM2("iso.le = %d", iso.le);
 
-	r = CmdTranslateTxBuffer(&iso, &tx_length, tx_buffer, &send_buf_trn);
-	if(r != IFD_SUCCESS)
-		return r;
+	start = GetTimeMs();
+
+	ins = InstructionFind(&iso);
+
+	stats->apdus++;
+	if (CacheLookup(reader_index, ins, &iso, rx_buffer, rx_length))
+	{
+		stats->cacheHits++;
+		return IFD_SUCCESS;
+	}
+
+	tpdu = iso;
+	if (tx_data)
+	{
+		tpdu.data = tx_data;
+		tpdu.lc = tpdu.len = tx_lc;
+	}
+	else
+	{
+		r = CmdTranslateTxBuffer(ins, &iso, &tpdu, Readers[reader_index].txScratch);
+		if(r != IFD_SUCCESS)
+			return r;
+	}
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&CancelMutex);
+#endif
+	device_descriptor->cancelled = FALSE;
+	device_descriptor->inFlight = TRUE;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&CancelMutex);
+#endif
+
+	/* long commands get more time, quick ones fail fast */
+	profile = InstructionProfileFind(&iso);
+	if (profile)
+	{
+		device_descriptor->readTimeout = profile->timeout;
+		device_descriptor->busyBudget = profile->busy;
+	}
+	else
+	{
+		device_descriptor->readTimeout = tuning->readTimeout;
+		device_descriptor->busyBudget = tuning->busyBudget;
+	}
 
-	if(send_buf_trn)
-		send_buf = send_buf_trn;
+	/* a read ahead done by CacheLookup() counted its own transfers */
+	transfers = stats->transfers;
 
-	switch(iso.cse)
+	switch(tpdu.cse)
 	{
 		case	IFD_APDU_CASE_2S:
 		case	IFD_APDU_CASE_3S:
-			if (iso.cla == 0 && iso.ins == 0xa4)
+			if (ins->flags & INS_GET_RESPONSE)
 				iscase4 = 1; /* FIXME: */
 		case	IFD_APDU_CASE_1:
-			r = CmdSendTPDU(reader_index, send_buf, tx_length,
-					rx_buffer, *rx_length, &rrecv, iscase4);
+			r = CmdSendTPDU(reader_index, &tpdu, ins, rx_buffer, *rx_length,
+					&rrecv, iscase4);
 			break;
 		case	IFD_APDU_CASE_4S:
 			// make send case 4 command
-			r = CmdSendTPDU(reader_index, send_buf, tx_length-1,
-					rx_buffer, *rx_length, &rrecv, 1);
+			r = CmdSendTPDU(reader_index, &tpdu, ins, rx_buffer, *rx_length,
+					&rrecv, 1);
 			break;
 		default:
 			break;
 	}
 
-	if (send_buf_trn)
-		free(send_buf_trn);
+	/* the tuning may have changed during the command */
+	device_descriptor->readTimeout = tuning->readTimeout;
+	device_descriptor->busyBudget = tuning->busyBudget;
+
+	stats->apduTransfers += stats->transfers - transfers;
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&CancelMutex);
+#endif
+	device_descriptor->inFlight = FALSE;
+	cancelled = device_descriptor->cancelled;
+	device_descriptor->cancelled = FALSE;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&CancelMutex);
+#endif
+
+	StatsCommand(reader_index, GetTimeMs() - start, r, cancelled);
+	/* the token is somewhere in the middle of the command */
+	if (cancelled && r != IFD_SUCCESS)
+		CmdResync(reader_index);
 
 	if(r != IFD_SUCCESS)
 	{
 		*rx_length = 0;
+		CacheUpdate(reader_index, ins, &iso, rx_buffer, 0);
 		return r;
 	}
 
-	return CmdTranslateRxBuffer(&iso, rx_length, rx_buffer, rrecv);
-} /* CmdXfrBlock */
+	r = CmdTranslateRxBuffer(ins, rx_length, rx_buffer, rrecv);
+	CacheUpdate(reader_index, ins, &iso, rx_buffer,
+		(IFD_SUCCESS == r) ? *rx_length : 0);
+
+	return r;
+} /* CmdXfrBlockTranslated */
 
 
 /*****************************************************************************
@@ -408,6 +619,9 @@ RESPONSECODE CmdTransmit(unsigned int reader_index, unsigned int tx_length,
 	unsigned char status;
 	int r;
 
+	if (CmdCancelled(reader_index))
+		return IFD_COMMUNICATION_ERROR;
+
 	/* Xfr Block */
 	r = ControlUSB(reader_index, 0x41, USB_ICC_XFR_BLOCK, 0, (unsigned char*)tx_buffer, tx_length);
 	/* we got an error? */
@@ -439,6 +653,9 @@ RESPONSECODE CmdReceive(unsigned int reader_index, unsigned int *rx_length,
 	int r;
 	unsigned char status;
 
+	if (CmdCancelled(reader_index))
+		return IFD_COMMUNICATION_ERROR;
+
 	/* Data Block */
 	r = ControlUSB(reader_index, 0xC1, USB_ICC_DATA_BLOCK, 0, rx_buffer, *rx_length);
 	/* we got an error? */
@@ -497,41 +714,51 @@ RESPONSECODE CmdReceiveSW(unsigned int reader_index, unsigned char sw[])
  *
  *					CmdPrepareT0Hdr
  *
+ *  return the case of the T=0 command
+ *  ins is NULL for GET RESPONSE
  ****************************************************************************/
-RESPONSECODE CmdPrepareT0Hdr(ifd_iso_apdu_t* iso, unsigned char hdr[])
+int CmdPrepareT0Hdr(const ifd_iso_apdu_t* iso, const _instruction* ins, unsigned char hdr[])
 {
-	switch(iso->cse){
+	int cse = iso->cse;
+
+	hdr[0] = iso->cla;
+	hdr[1] = iso->ins;
+	hdr[2] = iso->p1;
+	hdr[3] = iso->p2;
+	hdr[4] = 0;
+
+	switch(cse){
 		case	IFD_APDU_CASE_1:
 			// Fix Rutoken S 4-byte SELECT FILE ifd_iso_apdu_parse error
-			if (!(iso->cla == 0 && iso->ins == 0xa4))
+			if (!(ins && (ins->flags & INS_FORCE_CASE_2)))
 			{
 				// {cla, ins, p1, p2, 0};
 				DEBUG_COMM("case 1");
 				break;
 			}
 			else
-				iso->cse = IFD_APDU_CASE_2S;
+				cse = IFD_APDU_CASE_2S;
 		case    IFD_APDU_CASE_2S:
 			// {cla, ins, p1, p2, le};
-			// Rutoken Bug!!!
+			// Rutoken Bug!!! select file, get_do_info
 			DEBUG_COMM("case 2");
-			/* select file */
-			if (iso->cla == 0 && iso->ins == 0xa4)
-				iso->le = 0x20;
-			/* get_do_info */
-			else if (iso->cla == 0x80 && iso->ins == 0x30)
-				iso->le = 0xff;
-			hdr[4] = iso->le;
+			if (ins && ins->le)
+				hdr[4] = ins->le;
+			else
+				hdr[4] = iso->le;
 			break;
 		case    IFD_APDU_CASE_3S:
+		case    IFD_APDU_CASE_4S:
 			// {cla, ins, p1, p2, lc};
+			// the Le of a case 4 command is sent by GET RESPONSE
 			DEBUG_COMM("case 3");
+			cse = IFD_APDU_CASE_3S;
 			hdr[4] = iso->lc;
 			break;
 		default:
 			break;
 	}
-	return IFD_SUCCESS;
+	return cse;
 }/* CmdPrepareT0Hdr */
 
 /*****************************************************************************
@@ -540,30 +767,30 @@ RESPONSECODE CmdPrepareT0Hdr(ifd_iso_apdu_t* iso, unsigned char hdr[])
  *
  *  return in *rrecv how much bytes received
  ****************************************************************************/
-RESPONSECODE CmdSendTPDU(unsigned int reader_index, const void *sbuf,
-		size_t slen, void *rbuf, size_t rlen, int *rrecv, int iscase4)
+RESPONSECODE CmdSendTPDU(unsigned int reader_index, const ifd_iso_apdu_t *iso,
+		const _instruction *ins, void *rbuf, size_t rlen, int *rrecv,
+		int iscase4)
 {
 	int r = 0;
 	unsigned char status;
 	unsigned char sw[2];
-	ifd_iso_apdu_t iso;
-	DEBUG_COMM3("send tpdu command %s, len: %d", array_hexdump(sbuf, slen), slen);
+	unsigned char hdr[T0_HDR_LEN];
+	ifd_iso_apdu_t next;
+	int cse;
 
 	*rrecv = 0;
-	
-	if ( ifd_iso_apdu_parse(sbuf, slen, &iso) < 0 )
-		return IFD_COMMUNICATION_ERROR;
 
-	unsigned char hdr[T0_HDR_LEN]={iso.cla, iso.ins, iso.p1, iso.p2, 0};
-	CmdPrepareT0Hdr(&iso, hdr);
-	
+	cse = CmdPrepareT0Hdr(iso, ins, hdr);
+	DEBUG_COMM3("send tpdu header %s, lc: %d", array_hexdump(hdr, T0_HDR_LEN),
+		(IFD_APDU_CASE_3S == cse) ? iso->lc : 0);
+
 	//send TPDU header
 	r = CmdTransmit(reader_index, T0_HDR_LEN, hdr);
 	if ( r != IFD_SUCCESS)
 		return r;
 
 	// send TPDU data or get answer and sw
-	switch(iso.cse)
+	switch(cse)
 	{
 		case	IFD_APDU_CASE_1:
 			// get sw
@@ -574,7 +801,7 @@ RESPONSECODE CmdSendTPDU(unsigned int reader_index, const void *sbuf,
 		case    IFD_APDU_CASE_2S:
 		{
 			// get answere
-			DEBUG_COMM2("get Data %d", iso.le);
+			DEBUG_COMM2("get Data %d", hdr[4] ? hdr[4] : 256);
 
 			r = CmdGetSlotStatus(reader_index, &status);
 			if(r!= IFD_SUCCESS)
@@ -582,7 +809,7 @@ RESPONSECODE CmdSendTPDU(unsigned int reader_index, const void *sbuf,
 
 			if(status == ICC_STATUS_READY_DATA)
 			{
-				*rrecv = iso.le;
+				*rrecv = hdr[4] ? hdr[4] : 256;
 				r = CmdReceive(reader_index, rrecv, rbuf);
 				if (r != IFD_SUCCESS)
 					return r;
@@ -600,25 +827,26 @@ RESPONSECODE CmdSendTPDU(unsigned int reader_index, const void *sbuf,
 			}
 			if (sw[0] == 0x6c)
 			{
-				unsigned char sbuftmp[slen];
-				memcpy(sbuftmp, sbuf, slen);
-				sbuftmp[4] = sw[1];
-				return CmdSendTPDU(reader_index, sbuftmp, slen, rbuf,  rlen, rrecv, 0);
+				/* resend the command with the right Le */
+				next = *iso;
+				next.cse = IFD_APDU_CASE_2S;
+				next.le = sw[1] ? sw[1] : 256;
+				return CmdSendTPDU(reader_index, &next, ins, rbuf, rlen, rrecv, 0);
 			}
 		};
 			break;
 		case    IFD_APDU_CASE_3S:
 			// send data
-			DEBUG_COMM2("send Data %d", iso.lc);
-			
+			DEBUG_COMM2("send Data %d", iso->lc);
+
 			r = CmdGetSlotStatus(reader_index, &status);
 			if (r != IFD_SUCCESS)
 					return r;
 
 			if(status == ICC_STATUS_READY_DATA)
 			{
-				DEBUG_COMM2("send TPDU Data %s", array_hexdump(iso.data, iso.lc));
-				r = CmdTransmit(reader_index, iso.lc, iso.data);
+				DEBUG_COMM2("send TPDU Data %s", array_hexdump(iso->data, iso->lc));
+				r = CmdTransmit(reader_index, iso->lc, iso->data);
 				if (r != IFD_SUCCESS)
 					return r;
 			}
@@ -630,20 +858,17 @@ RESPONSECODE CmdSendTPDU(unsigned int reader_index, const void *sbuf,
 				return r;
 
 			// NOT STANDART TPDU!!! BEGIN
+			memset(&next, 0, sizeof(next));
+			next.cse = IFD_APDU_CASE_2S;
+			next.cla = 0x00;  //  iso->cla; (ruTokens specific)
+			next.ins = 0xc0; // ins get response
 			if ( sw[0]== 0x61){
-				unsigned char lx = sw[1];
-				hdr[0] = 0x00;  //  iso.cla; (ruTokens specific)
-				hdr[1] = 0xc0; // ins get response
-				hdr[2] = 0; // p1
-				hdr[3] = 0; // p2
-				hdr[4] = lx ; //lx (case 2)
+				next.le = sw[1] ? sw[1] : 256; //lx (case 2)
 				if(iscase4)
-					return CmdSendTPDU(reader_index, hdr,
-							T0_HDR_LEN, rbuf, rlen, rrecv, 0);
+					return CmdSendTPDU(reader_index, &next, NULL, rbuf, rlen, rrecv, 0);
 				else {
 					int recvtmp;
-					r = CmdSendTPDU(reader_index,
-							hdr, T0_HDR_LEN, rbuf, rlen, &recvtmp, 0);
+					r = CmdSendTPDU(reader_index, &next, NULL, rbuf, rlen, &recvtmp, 0);
 					if(r != IFD_SUCCESS)
 						return r;
 
@@ -655,13 +880,10 @@ RESPONSECODE CmdSendTPDU(unsigned int reader_index, const void *sbuf,
 
 			if ( (sw[0] == 0x90) && (sw[1] == 0x00))
 			{
-				hdr[0] = 0x00; //iso.cla;
-				hdr[1] = 0xc0; // ins get response
-				hdr[2] = 0; // p1
-				hdr[3] = 0; // p2
-				hdr[4] = iso.le; // le (case 2)
+				/* Le 0: the token tells the length with 6C xx */
+				next.le = 256;
 				if(iscase4)
-					return CmdSendTPDU(reader_index, hdr, T0_HDR_LEN, rbuf, rlen, rrecv, 0);
+					return CmdSendTPDU(reader_index, &next, NULL, rbuf, rlen, rrecv, 0);
 			}
 
 			// NOT STANDART TPDU!!! END
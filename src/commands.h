@@ -30,9 +30,19 @@ RESPONSECODE CmdPowerOff(unsigned int reader_index);
 
 RESPONSECODE CmdIccPresence(unsigned int reader_index, unsigned char* presence);
 
+int CmdIccPresenceShadow(unsigned int reader_index, unsigned int ttl,
+	unsigned char *presence);
+
 RESPONSECODE CmdXfrBlock(unsigned int reader_index, unsigned int tx_length,
 	unsigned char tx_buffer[], unsigned int *rx_length,
 	unsigned char rx_buffer[], int protoccol);
 
+RESPONSECODE CmdXfrBlockTranslated(unsigned int reader_index,
+	unsigned int tx_length, unsigned char tx_buffer[],
+	unsigned char tx_data[], unsigned int tx_lc, unsigned int *rx_length,
+	unsigned char rx_buffer[], int protocol);
+
+int CmdCancel(unsigned int reader_index);
+
 #endif
 
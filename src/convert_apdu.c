@@ -22,6 +22,7 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include "config.h"
 #include "convert_apdu.h"
 #include "debug.h"
 
@@ -165,56 +166,74 @@ int convert_fcp_to_rtprot(void *data, size_t data_len)
 
 int convert_rtprot_to_doinfo(void *data, size_t data_len)
 {
-	unsigned char doinfo[0xff] = { 0 };
+	unsigned char rtprot[32];
 	unsigned char *pdata = data;
-	size_t i, doinfo_len = 0;
+	size_t i, tags_len, body_len = 0, doinfo_len = 0;
+	int tag_80;
 
 	if (data_len < 32) {
 		DEBUG_COMM2("data_len = %u", data_len);
 		return -1;
 	}
-	if (pdata[0] != 0 && pdata[0] < sizeof(doinfo) - 4 - 4 - 5 - 42 - 2) {
+	/* converted in place: keep the rtprot header apart */
+	memcpy(rtprot, pdata, sizeof(rtprot));
+
+	/* 0x80, 0x83, 0x85 and 0x86 tags */
+	tag_80 = rtprot[0] != 0 && rtprot[0] < 0xff - 4 - 4 - 5 - 42 - 2;
+	tags_len = (tag_80 ? 4 : 0) + 4 + 5 + 42;
+	if (rtprot[0] != 0 && rtprot[0] + tags_len + 2 < 0xff) {
+		/* Tag 0xA5 */
+		if (data_len - 32 < rtprot[0]) {
+			DEBUG_INFO2("for tag 0xA5 incorrect data_len = %u", data_len);
+			return -1;
+		}
+		body_len = rtprot[0];
+	}
+	if (tags_len + (body_len ? 2 + body_len : 0) > data_len) {
+		DEBUG_COMM2("data_len = %u", data_len);
+		return -1;
+	}
+	/* the DO body moves after the tags */
+	if (body_len)
+		memmove(pdata + tags_len + 2, pdata + 32, body_len);
+
+	if (tag_80) {
 		/* Tag 0x80 */
-		doinfo[doinfo_len++] = 0x80;
-		doinfo[doinfo_len++] = 2;
-		memcpy(doinfo + doinfo_len, pdata, 2);
-		swap_pair(doinfo + doinfo_len, 2);
+		pdata[doinfo_len++] = 0x80;
+		pdata[doinfo_len++] = 2;
+		memcpy(pdata + doinfo_len, rtprot, 2);
+		swap_pair(pdata + doinfo_len, 2);
 		doinfo_len += 2;
 	}
 	/* Tag 0x83 */
-	doinfo[doinfo_len++] = 0x83;
-	doinfo[doinfo_len++] = 2;
-	doinfo[doinfo_len++] = pdata[2];
-	doinfo[doinfo_len++] = pdata[3];
+	pdata[doinfo_len++] = 0x83;
+	pdata[doinfo_len++] = 2;
+	pdata[doinfo_len++] = rtprot[2];
+	pdata[doinfo_len++] = rtprot[3];
 
 	/* Tag 0x85 */
-	doinfo[doinfo_len++] = 0x85;
-	doinfo[doinfo_len++] = 3;
-	doinfo[doinfo_len++] = pdata[4];
-	doinfo[doinfo_len++] = pdata[5];
-	doinfo[doinfo_len++] = pdata[6];
+	pdata[doinfo_len++] = 0x85;
+	pdata[doinfo_len++] = 3;
+	pdata[doinfo_len++] = rtprot[4];
+	pdata[doinfo_len++] = rtprot[5];
+	pdata[doinfo_len++] = rtprot[6];
 
 	/* Tag 0x86 */
-	doinfo[doinfo_len++] = 0x86;
-	doinfo[doinfo_len++] = 40;
-	memcpy(doinfo + doinfo_len, pdata + 17, 8);
+	pdata[doinfo_len++] = 0x86;
+	pdata[doinfo_len++] = 40;
+	memcpy(pdata + doinfo_len, rtprot + 17, 8);
 	doinfo_len += 8;
-	for (i = 0; i < 7 && doinfo_len + 3 < sizeof(doinfo); ++i, doinfo_len += 4)
-		doinfo[doinfo_len] = pdata[17 + 8 + i];
+	memset(pdata + doinfo_len, 0, 7 * 4 + 4);
+	for (i = 0; i < 7; ++i, doinfo_len += 4)
+		pdata[doinfo_len] = rtprot[17 + 8 + i];
 	doinfo_len += 4; /* for reserved */
-	if (pdata[0] != 0 && pdata[0] + doinfo_len + 2 < sizeof(doinfo)) {
+	if (body_len) {
 		/* Tag 0xA5 */
-		if (data_len - 32 < pdata[0]) {
-			DEBUG_INFO2("for tag 0xA5 incorrect data_len = %u", data_len);
-			return -1;
-		}
-		doinfo[doinfo_len++] = 0xA5;
-		doinfo[doinfo_len++] = pdata[0];
-		memcpy(doinfo + doinfo_len, pdata + 32, pdata[0]);
-		doinfo_len += pdata[0];
+		pdata[doinfo_len++] = 0xA5;
+		pdata[doinfo_len++] = body_len;
+		doinfo_len += body_len;
 	}
-	DEBUG_COMM2("doinfo = %s", array_hexdump(doinfo, doinfo_len));
-	memcpy(data, doinfo, doinfo_len);
+	DEBUG_COMM2("doinfo = %s", array_hexdump(pdata, doinfo_len));
 	return doinfo_len;
 }
 
@@ -257,4 +276,24 @@ int convert_rtprot_to_fcp(void *data, size_t data_len)
 	DEBUG_COMM2("fcp = %s", array_hexdump(fcp, sizeof(fcp)));
 	memcpy(data, fcp, sizeof(fcp));
 	return sizeof(fcp);
-}
\ No newline at end of file
+}
+
+/* return the value of a len bytes long tag of the FCP template or NULL */
+const unsigned char *fcp_find_tag(const unsigned char *fcp, size_t fcp_len,
+		unsigned char tag, size_t len)
+{
+	size_t i;
+
+	if (fcp_len < 2 || fcp[0] != FCP_TAG_TEMPLATE || fcp[1] + 2u > fcp_len)
+		return NULL;
+
+	fcp_len = fcp[1] + 2;
+	for (i = 2; i + 2 <= fcp_len; i += 2 + fcp[i + 1]) {
+		if (i + 2 + fcp[i + 1] > fcp_len)
+			return NULL;
+		if (fcp[i] == tag)
+			return (fcp[i + 1] == len) ? fcp + i + 2 : NULL;
+	}
+
+	return NULL;
+}
@@ -27,12 +27,25 @@
 extern "C" {
 #endif
 
+#define FID_MF	0x3F00
+
+/* FCP tags */
+#define FCP_TAG_TEMPLATE	0x62
+#define FCP_TAG_FILE_SIZE	0x80
+#define FCP_TAG_FILE_TYPE	0x82
+#define FCP_TAG_FILE_ID		0x83
+
+/* file descriptor byte of a DF */
+#define FILE_TYPE_DF	0x38
+
 void swap_pair(unsigned char *buf, size_t len);
 void swap_four(unsigned char *buf, size_t len);
 int convert_doinfo_to_rtprot(void *data, size_t data_len);
 int convert_fcp_to_rtprot(void *data, size_t data_len);
 int convert_rtprot_to_doinfo(void *data, size_t data_len);
 int convert_rtprot_to_fcp(void *data, size_t data_len);
+const unsigned char *fcp_find_tag(const unsigned char *fcp, size_t fcp_len,
+		unsigned char tag, size_t len);
 
 #ifdef __cplusplus
 }
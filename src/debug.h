@@ -21,7 +21,7 @@
 
 /*
  * DEBUG_CRITICAL("text");
- * 	log "text" if (LogLevel & DEBUG_LEVEL_CRITICAL) is TRUE
+ * 	log "text" if (LOG_LEVEL & DEBUG_LEVEL_CRITICAL) is TRUE
  *
  * DEBUG_CRITICAL2("text: %d", 1234);
  *  log "text: 1234" if (DEBUG_LEVEL_CRITICAL & DEBUG_LEVEL_CRITICAL) is TRUE
@@ -30,7 +30,7 @@
  * same thing for DEBUG_INFO, DEBUG_COMM and DEBUG_PERIODIC
  *
  * DEBUG_XXD(msg, buffer, size);
- *  log a dump of buffer if (LogLevel & DEBUG_LEVEL_COMM) is TRUE
+ *  log a dump of buffer if (LOG_LEVEL & DEBUG_LEVEL_COMM) is TRUE
  *
  */
 
@@ -44,6 +44,18 @@
 
 extern int LogLevel;
 
+/* LogLevel of the reader the thread works for, -1 to use LogLevel */
+#ifdef HAVE___THREAD
+extern __thread int LogThreadLevel;
+
+#define LOG_LEVEL ((LogThreadLevel >= 0) ? LogThreadLevel : LogLevel)
+#else
+/* shared by the threads, only LogLevel can be trusted */
+extern int LogThreadLevel;
+
+#define LOG_LEVEL LogLevel
+#endif
+
 #define DEBUG_LEVEL_CRITICAL 1
 #define DEBUG_LEVEL_INFO     2
 #define DEBUG_LEVEL_COMM     4
@@ -52,41 +64,41 @@ extern int LogLevel;
 #include <debuglog.h>
 
 /* DEBUG_CRITICAL */
-#define DEBUG_CRITICAL(fmt) if (LogLevel & DEBUG_LEVEL_CRITICAL) Log1(PCSC_LOG_CRITICAL, fmt); else (fmt)
+#define DEBUG_CRITICAL(fmt) if (LOG_LEVEL & DEBUG_LEVEL_CRITICAL) Log1(PCSC_LOG_CRITICAL, fmt); else (fmt)
 
-#define DEBUG_CRITICAL2(fmt, data) if (LogLevel & DEBUG_LEVEL_CRITICAL) Log2(PCSC_LOG_CRITICAL, fmt, data); else (fmt, data)
+#define DEBUG_CRITICAL2(fmt, data) if (LOG_LEVEL & DEBUG_LEVEL_CRITICAL) Log2(PCSC_LOG_CRITICAL, fmt, data); else (fmt, data)
 
-#define DEBUG_CRITICAL3(fmt, data1, data2) if (LogLevel & DEBUG_LEVEL_CRITICAL) Log3(PCSC_LOG_CRITICAL, fmt, data1, data2); else (fmt, data1, data2)
+#define DEBUG_CRITICAL3(fmt, data1, data2) if (LOG_LEVEL & DEBUG_LEVEL_CRITICAL) Log3(PCSC_LOG_CRITICAL, fmt, data1, data2); else (fmt, data1, data2)
 
-#define DEBUG_CRITICAL4(fmt, data1, data2, data3) if (LogLevel & DEBUG_LEVEL_CRITICAL) Log4(PCSC_LOG_CRITICAL, fmt, data1, data2, data3); else (fmt, data1, data2, data3)
+#define DEBUG_CRITICAL4(fmt, data1, data2, data3) if (LOG_LEVEL & DEBUG_LEVEL_CRITICAL) Log4(PCSC_LOG_CRITICAL, fmt, data1, data2, data3); else (fmt, data1, data2, data3)
 
 /* DEBUG_INFO */
-#define DEBUG_INFO(fmt) if (LogLevel & DEBUG_LEVEL_INFO) Log1(PCSC_LOG_INFO, fmt); else (fmt)
+#define DEBUG_INFO(fmt) if (LOG_LEVEL & DEBUG_LEVEL_INFO) Log1(PCSC_LOG_INFO, fmt); else (fmt)
 
-#define DEBUG_INFO2(fmt, data) if (LogLevel & DEBUG_LEVEL_INFO) Log2(PCSC_LOG_INFO, fmt, data); else (fmt, data)
+#define DEBUG_INFO2(fmt, data) if (LOG_LEVEL & DEBUG_LEVEL_INFO) Log2(PCSC_LOG_INFO, fmt, data); else (fmt, data)
 
-#define DEBUG_INFO3(fmt, data1, data2) if (LogLevel & DEBUG_LEVEL_INFO) Log3(PCSC_LOG_INFO, fmt, data1, data2); else (fmt, data1, data2)
+#define DEBUG_INFO3(fmt, data1, data2) if (LOG_LEVEL & DEBUG_LEVEL_INFO) Log3(PCSC_LOG_INFO, fmt, data1, data2); else (fmt, data1, data2)
 
-#define DEBUG_INFO4(fmt, data1, data2, data3) if (LogLevel & DEBUG_LEVEL_INFO) Log4(PCSC_LOG_INFO, fmt, data1, data2, data3); else (fmt, data1, data2, data3)
+#define DEBUG_INFO4(fmt, data1, data2, data3) if (LOG_LEVEL & DEBUG_LEVEL_INFO) Log4(PCSC_LOG_INFO, fmt, data1, data2, data3); else (fmt, data1, data2, data3)
 
-#define DEBUG_INFO_XXD(msg, buffer, size) if (LogLevel & DEBUG_LEVEL_INFO) log_xxd(PCSC_LOG_INFO, msg, buffer, size); else (msg, buffer, size)
+#define DEBUG_INFO_XXD(msg, buffer, size) if (LOG_LEVEL & DEBUG_LEVEL_INFO) log_xxd(PCSC_LOG_INFO, msg, buffer, size); else (msg, buffer, size)
 
 /* DEBUG_PERIODIC */
-#define DEBUG_PERIODIC(fmt) if (LogLevel & DEBUG_LEVEL_PERIODIC) Log1(PCSC_LOG_DEBUG, fmt); else (fmt)
+#define DEBUG_PERIODIC(fmt) if (LOG_LEVEL & DEBUG_LEVEL_PERIODIC) Log1(PCSC_LOG_DEBUG, fmt); else (fmt)
 
-#define DEBUG_PERIODIC2(fmt, data) if (LogLevel & DEBUG_LEVEL_PERIODIC) Log2(PCSC_LOG_DEBUG, fmt, data); else (fmt, data)
+#define DEBUG_PERIODIC2(fmt, data) if (LOG_LEVEL & DEBUG_LEVEL_PERIODIC) Log2(PCSC_LOG_DEBUG, fmt, data); else (fmt, data)
 
 /* DEBUG_COMM */
-#define DEBUG_COMM(fmt) if (LogLevel & DEBUG_LEVEL_COMM) Log1(PCSC_LOG_DEBUG, fmt); else (fmt)
+#define DEBUG_COMM(fmt) if (LOG_LEVEL & DEBUG_LEVEL_COMM) Log1(PCSC_LOG_DEBUG, fmt); else (fmt)
 
-#define DEBUG_COMM2(fmt, data) if (LogLevel & DEBUG_LEVEL_COMM) Log2(PCSC_LOG_DEBUG, fmt, data); else (fmt, data)
+#define DEBUG_COMM2(fmt, data) if (LOG_LEVEL & DEBUG_LEVEL_COMM) Log2(PCSC_LOG_DEBUG, fmt, data); else (fmt, data)
 
-#define DEBUG_COMM3(fmt, data1, data2) if (LogLevel & DEBUG_LEVEL_COMM) Log3(PCSC_LOG_DEBUG, fmt, data1, data2); else (fmt, data1, data2)
+#define DEBUG_COMM3(fmt, data1, data2) if (LOG_LEVEL & DEBUG_LEVEL_COMM) Log3(PCSC_LOG_DEBUG, fmt, data1, data2); else (fmt, data1, data2)
 
-#define DEBUG_COMM4(fmt, data1, data2, data3) if (LogLevel & DEBUG_LEVEL_COMM) Log4(PCSC_LOG_DEBUG, fmt, data1, data2, data3); else (fmt, data1, data2, data3)
+#define DEBUG_COMM4(fmt, data1, data2, data3) if (LOG_LEVEL & DEBUG_LEVEL_COMM) Log4(PCSC_LOG_DEBUG, fmt, data1, data2, data3); else (fmt, data1, data2, data3)
 
 /* DEBUG_XXD */
-#define DEBUG_XXD(msg, buffer, size) if (LogLevel & DEBUG_LEVEL_COMM) log_xxd(PCSC_LOG_DEBUG, msg, buffer, size); else (msg, buffer, size)
+#define DEBUG_XXD(msg, buffer, size) if (LOG_LEVEL & DEBUG_LEVEL_COMM) log_xxd(PCSC_LOG_DEBUG, msg, buffer, size); else (msg, buffer, size)
 
 #endif
 
@@ -33,6 +33,11 @@ typedef struct DEV_DESC
 	 * Card state
 	 */
 	UCHAR bPowerFlags;
+
+	/*
+	 * GetTimeMs() date of a deferred power down
+	 */
+	unsigned long long ullPowerDownTime;
 } DevDesc;
 
 typedef enum {
@@ -53,6 +58,11 @@ typedef enum {
 #define MASK_POWERFLAGS_PUP 0x01
 /* Flag set when a power down is requested */
 #define MASK_POWERFLAGS_PDWN 0x02
+/* Flag set when the power down is deferred, the card is still powered */
+#define MASK_POWERFLAGS_PDWN_DEFERRED 0x04
+/* Flag set when the driver power cycled the card on its own, the resource
+ * manager is told the card was removed */
+#define MASK_POWERFLAGS_RESYNC 0x08
 
 /* Communication buffer size (max=adpu+Lc+data+Le) */
 #define CMD_BUF_SIZE (4+1+256+1)
@@ -63,6 +73,13 @@ typedef enum {
 #define T_0 0
 #define T_1 1
 
-/* Default communication read timeout in seconds */
-#define DEFAULT_COM_READ_TIMEOUT 2
+/* Default communication read timeout in milliseconds */
+#define DEFAULT_COM_READ_TIMEOUT 2000
+
+/* Default number of busy status polls (10 ms) in a row without progress
+ * of the token */
+#define DEFAULT_BUSY_BUDGET 10
+
+/* Default delay in milliseconds between two busy status polls */
+#define DEFAULT_BUSY_INTERVAL 10
 
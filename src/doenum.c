@@ -0,0 +1,147 @@
+/*
+    doenum.c: enumeration of the data objects of the token
+    Copyright (C) 2012 Aktiv Co
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public License
+	along with this library; if not, write to the Free Software Foundation,
+	Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include <string.h>
+#include <pcsclite.h>
+#include <ifdhandler.h>
+
+#include "misc.h"
+#include "config.h"
+#include "defs.h"
+#include "debug.h"
+#include "commands.h"
+#include "doenum.h"
+#include "rutokens_ctl.h"
+
+/* p1 p2 first last offset misses length */
+#define DO_ENUM_IN_HDR_LEN	7
+/* result + SW + next */
+#define DO_ENUM_OUT_HDR_LEN	4
+/* id + length */
+#define DO_ENUM_DESC_HDR_LEN	2
+
+/* get_do_info: 80 30 p1 p2 lc data le */
+#define DO_ENUM_APDU_HDR_LEN	5
+
+
+/*****************************************************************************
+ *
+ *					DoEnumRun
+ *
+ ****************************************************************************/
+RESPONSECODE DoEnumRun(unsigned int reader_index,
+	const unsigned char in[], unsigned int in_length,
+	unsigned char out[], unsigned int *out_length)
+{
+	unsigned char apdu[CMD_BUF_SIZE];
+	unsigned char resp[RESP_BUF_SIZE];
+	unsigned int resp_length;
+	unsigned int out_size = *out_length;
+	unsigned int out_used = DO_ENUM_OUT_HDR_LEN;
+	unsigned int id, last, offset, max_misses, misses = 0, len;
+	unsigned char sw[2] = { 0, 0 };
+	unsigned char result = DO_ENUM_RESULT_END;
+	RESPONSECODE r;
+
+	*out_length = 0;
+
+	if (in_length < DO_ENUM_IN_HDR_LEN || out_size < DO_ENUM_OUT_HDR_LEN)
+		return IFD_COMMUNICATION_ERROR;
+
+	id = in[2];
+	last = in[3];
+	offset = in[4];
+	max_misses = in[5];
+	len = in[6];
+	if (len < 1 || offset >= len
+		|| len > in_length - DO_ENUM_IN_HDR_LEN
+		|| DO_ENUM_APDU_HDR_LEN + len + 1 > sizeof(apdu))
+		return IFD_COMMUNICATION_ERROR;
+
+	apdu[0] = 0x80;
+	apdu[1] = 0x30;
+	apdu[2] = in[0];
+	apdu[3] = in[1];
+	apdu[4] = len;
+	memcpy(apdu + DO_ENUM_APDU_HDR_LEN, in + DO_ENUM_IN_HDR_LEN, len);
+	/* the DO info is at most 0xFF bytes long */
+	apdu[DO_ENUM_APDU_HDR_LEN + len] = 0xFF;
+
+	for (; id <= last; id++)
+	{
+		apdu[DO_ENUM_APDU_HDR_LEN + offset] = id;
+
+		/* the answer is translated and cached by CmdXfrBlock */
+		resp_length = sizeof(resp);
+		r = CmdXfrBlock(reader_index, DO_ENUM_APDU_HDR_LEN + len + 1, apdu,
+			&resp_length, resp, T_0);
+		if (r != IFD_SUCCESS)
+			return r;
+		if (resp_length < sizeof(sw))
+			return IFD_COMMUNICATION_ERROR;
+
+		resp_length -= sizeof(sw);
+		memcpy(sw, resp + resp_length, sizeof(sw));
+
+		if (0x6A == sw[0] && 0x82 == sw[1])
+		{
+			/* no DO of this id */
+			if (++misses > max_misses)
+			{
+				/* running out of misses on last still ends the range */
+				if (id < last)
+					result = DO_ENUM_RESULT_MISSES;
+				id++;
+				break;
+			}
+			continue;
+		}
+
+		if (sw[0] != 0x90 || sw[1] != 0x00)
+		{
+			result = DO_ENUM_RESULT_SW_ERROR;
+			break;
+		}
+
+		if (DO_ENUM_DESC_HDR_LEN + resp_length > out_size - out_used)
+		{
+			/* the caller goes on from this id */
+			result = DO_ENUM_RESULT_OVERFLOW;
+			break;
+		}
+		out[out_used++] = id;
+		out[out_used++] = resp_length;
+		memcpy(out + out_used, resp, resp_length);
+		out_used += resp_length;
+		misses = 0;
+	}
+
+	DEBUG_COMM3("DO enumeration stopped at id %u, result %u", id, result);
+
+	out[0] = result;
+	out[1] = sw[0];
+	out[2] = sw[1];
+	/* meaningless once the whole range is done, last + 1 may be 0x100 */
+	out[3] = id;
+	*out_length = out_used;
+
+	return IFD_SUCCESS;
+} /* DoEnumRun */
+
@@ -0,0 +1,300 @@
+/*
+    entropy.c: pool of random bytes of the token
+    Copyright (C) 2012 Aktiv Co
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public License
+	along with this library; if not, write to the Free Software Foundation,
+	Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <pcsclite.h>
+#include <ifdhandler.h>
+
+#include "misc.h"
+#include "config.h"
+#include "rutokens.h"
+#include "defs.h"
+#include "debug.h"
+#include "utils.h"
+#include "parser.h"
+#include "commands.h"
+#include "entropy.h"
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+typedef struct
+{
+	/* the reader is open */
+	int active;
+
+	unsigned int head;
+	unsigned int count;
+	unsigned char data[ENTROPY_MAX_POOL];
+} _pool;
+
+/* ne need to initialize to 0 since it is static */
+static _pool Pools[DRIVER_MAX_READERS];
+
+/* Size of the pools filled at power up (0: no pool) */
+static unsigned int PoolSize = 0;
+
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t EntropyMutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+
+/*****************************************************************************
+ *
+ *					PoolPut
+ *
+ *  return the number of bytes stored
+ ****************************************************************************/
+static unsigned int PoolPut(int reader_index, const unsigned char data[],
+	unsigned int length)
+{
+	_pool *pool = &Pools[reader_index];
+	unsigned int i;
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&EntropyMutex);
+#endif
+	for (i=0; i<length && pool->active && pool->count < PoolSize; i++)
+	{
+		pool->data[(pool->head + pool->count) % ENTROPY_MAX_POOL] = data[i];
+		pool->count++;
+	}
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&EntropyMutex);
+#endif
+
+	return i;
+} /* PoolPut */
+
+
+/*****************************************************************************
+ *
+ *					PoolTake
+ *
+ *  return the number of bytes taken, the bytes are removed from the pool
+ ****************************************************************************/
+static unsigned int PoolTake(int reader_index, unsigned char data[],
+	unsigned int length)
+{
+	_pool *pool = &Pools[reader_index];
+	unsigned int i;
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&EntropyMutex);
+#endif
+	for (i=0; i<length && pool->count > 0; i++)
+	{
+		data[i] = pool->data[pool->head];
+		pool->data[pool->head] = 0;
+		pool->head = (pool->head + 1) % ENTROPY_MAX_POOL;
+		pool->count--;
+	}
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&EntropyMutex);
+#endif
+
+	return i;
+} /* PoolTake */
+
+
+/*****************************************************************************
+ *
+ *					EntropyFetch
+ *
+ *  send a GET CHALLENGE of ENTROPY_CHUNK bytes to the token, the reader
+ *  must be locked
+ ****************************************************************************/
+static RESPONSECODE EntropyFetch(int reader_index,
+	unsigned char data[ENTROPY_CHUNK])
+{
+	unsigned char apdu[] = { 0x00, 0x84, 0x00, 0x00, ENTROPY_CHUNK };
+	unsigned char rx_buffer[ENTROPY_CHUNK + 2];
+	unsigned int rx_length = sizeof(rx_buffer);
+	RESPONSECODE r;
+
+	r = CmdXfrBlock(reader_index, sizeof(apdu), apdu, &rx_length, rx_buffer,
+		T_0);
+
+	if (r != IFD_SUCCESS)
+		return r;
+
+	if (rx_length != sizeof(rx_buffer) || rx_buffer[ENTROPY_CHUNK] != 0x90
+		|| rx_buffer[ENTROPY_CHUNK + 1] != 0x00)
+	{
+		DEBUG_CRITICAL2("GET CHALLENGE failed: %s",
+			array_hexdump(rx_buffer, rx_length));
+		return IFD_COMMUNICATION_ERROR;
+	}
+
+	memcpy(data, rx_buffer, ENTROPY_CHUNK);
+	memset(rx_buffer, 0, sizeof(rx_buffer));
+
+	return IFD_SUCCESS;
+} /* EntropyFetch */
+
+
+/*****************************************************************************
+ *
+ *					EntropyInit
+ *
+ ****************************************************************************/
+void EntropyInit(const char infofile[])
+{
+	char keyValue[TOKEN_MAX_VALUE_SIZE];
+
+	if (LTPBundleFindValueWithKey(infofile, "ifdEntropyPool", keyValue, 0))
+		return;
+
+	PoolSize = strtoul(keyValue, NULL, 0);
+	if (PoolSize > ENTROPY_MAX_POOL)
+		PoolSize = ENTROPY_MAX_POOL;
+	DEBUG_INFO2("EntropyPool: %u bytes", PoolSize);
+} /* EntropyInit */
+
+
+/*****************************************************************************
+ *
+ *					EntropyStart
+ *
+ ****************************************************************************/
+void EntropyStart(int reader_index)
+{
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&EntropyMutex);
+#endif
+	Pools[reader_index].active = TRUE;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&EntropyMutex);
+#endif
+} /* EntropyStart */
+
+
+/*****************************************************************************
+ *
+ *					EntropyStop
+ *
+ *  the reader must be locked
+ ****************************************************************************/
+void EntropyStop(int reader_index)
+{
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&EntropyMutex);
+#endif
+	memset(&Pools[reader_index], 0, sizeof(Pools[reader_index]));
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&EntropyMutex);
+#endif
+} /* EntropyStop */
+
+
+/*****************************************************************************
+ *
+ *					EntropyFill
+ *
+ *  fill the pool of a reader whose token was just powered up or reset
+ *  for pcscd, the reader must be locked. No application has a command
+ *  chain or a security state on the token yet.
+ ****************************************************************************/
+void EntropyFill(int reader_index)
+{
+	unsigned char data[ENTROPY_CHUNK];
+	int wanted;
+
+	for (;;)
+	{
+#ifdef HAVE_PTHREAD
+		pthread_mutex_lock(&EntropyMutex);
+#endif
+		wanted = Pools[reader_index].active
+			&& Pools[reader_index].count + ENTROPY_CHUNK <= PoolSize;
+#ifdef HAVE_PTHREAD
+		pthread_mutex_unlock(&EntropyMutex);
+#endif
+		if (!wanted || EntropyFetch(reader_index, data) != IFD_SUCCESS)
+			break;
+
+		(void)PoolPut(reader_index, data, sizeof(data));
+	}
+	memset(data, 0, sizeof(data));
+
+	DEBUG_INFO2("%u bytes in the pool", Pools[reader_index].count);
+} /* EntropyFill */
+
+
+/*****************************************************************************
+ *
+ *					EntropyDrain
+ *
+ ****************************************************************************/
+RESPONSECODE EntropyDrain(unsigned int reader_index,
+	const unsigned char in[], unsigned int in_length,
+	unsigned char out[], unsigned int *out_length)
+{
+	unsigned int out_size = *out_length;
+	unsigned char data[ENTROPY_CHUNK];
+	unsigned int length, pos, n;
+	RESPONSECODE r;
+
+	*out_length = 0;
+
+	if (in_length != 2)
+	{
+		DEBUG_CRITICAL("Malformed entropy request");
+		return IFD_COMMUNICATION_ERROR;
+	}
+
+	length = (in[0] << 8) | in[1];
+	if (length > out_size)
+	{
+		DEBUG_CRITICAL2("Answer buffer too small: %u", out_size);
+		return IFD_COMMUNICATION_ERROR;
+	}
+
+	pos = PoolTake(reader_index, out, length);
+	DEBUG_INFO3("%u bytes, %u from the pool", length, pos);
+
+	/* the token gives the missing bytes now */
+	while (pos < length)
+	{
+		r = EntropyFetch(reader_index, data);
+		if (r != IFD_SUCCESS)
+		{
+			memset(out, 0, pos);
+			return r;
+		}
+
+		n = length - pos;
+		if (n > sizeof(data))
+			n = sizeof(data);
+		memcpy(out + pos, data, n);
+		pos += n;
+
+		/* keep the rest for the next time */
+		(void)PoolPut(reader_index, data + n, sizeof(data) - n);
+	}
+	memset(data, 0, sizeof(data));
+
+	*out_length = length;
+
+	return IFD_SUCCESS;
+} /* EntropyDrain */
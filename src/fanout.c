@@ -0,0 +1,247 @@
+/*
+    fanout.c: run a script on several tokens at once
+    Copyright (C) 2012 Aktiv Co
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public License
+	along with this library; if not, write to the Free Software Foundation,
+	Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+
+#include <string.h>
+#include <pcsclite.h>
+#include <ifdhandler.h>
+
+#include "misc.h"
+#include "config.h"
+#include "rutokens.h"
+#include "defs.h"
+#include "debug.h"
+#include "utils.h"
+#include "script.h"
+#include "fanout.h"
+#include "rutokens_ctl.h"
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+/* lun + status + length */
+#define FAN_OUT_TOKEN_HDR_LEN	7
+
+typedef struct
+{
+	/* n lun[4]{n} */
+	const unsigned char *luns;
+	unsigned int count;
+
+	const unsigned char *script;
+	unsigned int script_length;
+
+	/* each token answers in its own share of out */
+	unsigned char *out;
+	unsigned int share;
+
+	void (*prepare)(int reader_index);
+
+	/* the only reader which may be used, -1 for any */
+	int only;
+
+	/* next token to serve */
+	unsigned int next;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_t mutex;
+#endif
+} _fan_out;
+
+
+/*****************************************************************************
+ *
+ *					FanOutNext
+ *
+ *  return the index of the next token to serve, count if none is left
+ ****************************************************************************/
+static unsigned int FanOutNext(_fan_out *fan)
+{
+	unsigned int i;
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&fan->mutex);
+#endif
+	i = fan->next;
+	if (i < fan->count)
+		fan->next++;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&fan->mutex);
+#endif
+
+	return i;
+} /* FanOutNext */
+
+
+/*****************************************************************************
+ *
+ *					FanOutToken
+ *
+ ****************************************************************************/
+static void FanOutToken(_fan_out *fan, unsigned int i)
+{
+	const unsigned char *l = fan->luns + 4 * i;
+	unsigned char *p = fan->out + fan->share * i;
+	unsigned int len = 0;
+	int lun, reader_index;
+
+	lun = (l[0] << 24) | (l[1] << 16) | (l[2] << 8) | l[3];
+	memcpy(p, l, 4);
+	p[4] = FAN_OUT_STATUS_NO_READER;
+
+	reader_index = LunToReaderIndex(lun);
+	if (reader_index != -1 && fan->only != -1 && reader_index != fan->only)
+		p[4] = FAN_OUT_STATUS_DENIED;
+	else if (reader_index != -1)
+	{
+		LogReader(reader_index);
+
+		ReaderLock(reader_index);
+
+		/* the reader may have been closed while we waited for it */
+		if (LunToReaderIndex(lun) == reader_index)
+		{
+			if (fan->prepare)
+				fan->prepare(reader_index);
+
+			len = fan->share - FAN_OUT_TOKEN_HDR_LEN;
+			if (IFD_SUCCESS == ScriptRun(reader_index, fan->script,
+				fan->script_length, p + FAN_OUT_TOKEN_HDR_LEN, &len))
+				p[4] = FAN_OUT_STATUS_DONE;
+			else
+			{
+				p[4] = FAN_OUT_STATUS_ERROR;
+				len = 0;
+			}
+		}
+
+		ReaderUnlock(reader_index);
+	}
+
+	DEBUG_INFO3("lun: %X, status: %d", lun, p[4]);
+
+	p[5] = len >> 8;
+	p[6] = len;
+} /* FanOutToken */
+
+
+/*****************************************************************************
+ *
+ *					FanOutWorker
+ *
+ ****************************************************************************/
+static void *FanOutWorker(void *arg)
+{
+	_fan_out *fan = arg;
+	int level = LogThreadLevel;
+	unsigned int i;
+
+	while ((i = FanOutNext(fan)) < fan->count)
+		FanOutToken(fan, i);
+
+	LogThreadLevel = level;
+
+	return NULL;
+} /* FanOutWorker */
+
+
+/*****************************************************************************
+ *
+ *					FanOutRun
+ *
+ *  prepare is called for each token, with its reader locked, before the
+ *  script is run. Only the reader only is used, unless only is -1.
+ ****************************************************************************/
+RESPONSECODE FanOutRun(int only, const unsigned char in[],
+	unsigned int in_length, unsigned char out[], unsigned int *out_length,
+	void (*prepare)(int reader_index))
+{
+	unsigned int out_size = *out_length;
+	unsigned int i, len, pos;
+	_fan_out fan;
+#ifdef HAVE_PTHREAD
+	pthread_t threads[FAN_OUT_THREADS];
+	unsigned int nthreads = 0;
+#endif
+
+	*out_length = 0;
+
+	if (in_length < 1 || 0 == in[0] || in[0] > FAN_OUT_MAX_TOKENS
+		|| in_length < 1 + 4 * (unsigned int)in[0])
+	{
+		DEBUG_CRITICAL("Malformed fan-out");
+		return IFD_COMMUNICATION_ERROR;
+	}
+
+	fan.count = in[0];
+	fan.luns = in + 1;
+	fan.script = in + 1 + 4 * fan.count;
+	fan.script_length = in_length - 1 - 4 * fan.count;
+	fan.out = out;
+	fan.share = out_size / fan.count;
+	fan.prepare = prepare;
+	fan.only = only;
+	fan.next = 0;
+
+	if (fan.share < FAN_OUT_TOKEN_HDR_LEN)
+	{
+		DEBUG_CRITICAL2("Answer buffer too small: %u", out_size);
+		return IFD_COMMUNICATION_ERROR;
+	}
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_init(&fan.mutex, NULL);
+
+	/* the calling thread is a worker too */
+	while (nthreads + 1 < fan.count && nthreads + 1 < FAN_OUT_THREADS)
+	{
+		if (pthread_create(&threads[nthreads], NULL, FanOutWorker, &fan))
+		{
+			DEBUG_CRITICAL("Can't start a fan-out worker");
+			break;
+		}
+		nthreads++;
+	}
+	DEBUG_INFO3("%u tokens, %u workers", fan.count, nthreads + 1);
+#endif
+
+	(void)FanOutWorker(&fan);
+
+#ifdef HAVE_PTHREAD
+	for (i=0; i<nthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	pthread_mutex_destroy(&fan.mutex);
+#endif
+
+	/* put the answers of the tokens one after the other */
+	pos = 0;
+	for (i=0; i<fan.count; i++)
+	{
+		const unsigned char *p = out + fan.share * i;
+
+		len = FAN_OUT_TOKEN_HDR_LEN + ((p[5] << 8) | p[6]);
+		memmove(out + pos, p, len);
+		pos += len;
+	}
+	*out_length = pos;
+
+	return IFD_SUCCESS;
+} /* FanOutRun */
@@ -0,0 +1,34 @@
+/*
+    fanout.h: run a script on several tokens at once
+    Copyright (C) 2012 Aktiv Co
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public License
+	along with this library; if not, write to the Free Software Foundation,
+	Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+
+#ifndef FANOUT_H
+#define FANOUT_H
+
+/* Number of worker threads of a fan-out */
+#define FAN_OUT_THREADS	8
+/* Number of tokens of a fan-out */
+#define FAN_OUT_MAX_TOKENS	DRIVER_MAX_READERS
+
+RESPONSECODE FanOutRun(int only, const unsigned char in[],
+	unsigned int in_length, unsigned char out[], unsigned int *out_length,
+	void (*prepare)(int reader_index));
+
+#endif
@@ -0,0 +1,346 @@
+/*
+    fstree.c: snapshot of the file system of the token
+    Copyright (C) 2012 Aktiv Co
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public License
+	along with this library; if not, write to the Free Software Foundation,
+	Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include <string.h>
+#include <pcsclite.h>
+#include <ifdhandler.h>
+
+#include "misc.h"
+#include "config.h"
+#include "defs.h"
+#include "debug.h"
+#include "utils.h"
+#include "commands.h"
+#include "convert_apdu.h"
+#include "fstree.h"
+#include "rutokens_ctl.h"
+
+/* max depth + MF */
+#define FS_TREE_IN_HDR_LEN	3
+/* result + SW */
+#define FS_TREE_OUT_HDR_LEN	3
+/* depth + fid + length */
+#define FS_TREE_REC_HDR_LEN	4
+
+typedef struct
+{
+	unsigned int reader_index;
+	unsigned char *out;
+	unsigned int out_size;
+	unsigned int out_used;
+	/* depth of the deepest files recorded */
+	unsigned int max_depth;
+	int truncated;
+	/* FS_TREE_RESULT_END until the walk is stopped */
+	unsigned char result;
+	unsigned char sw[2];
+	/* path from the MF of the current DF */
+	unsigned short path[FS_TREE_MAX_PATH];
+} _fs_tree;
+
+/* internal functions */
+
+static RESPONSECODE FsTreeSend(_fs_tree *tree, const unsigned char apdu[],
+	unsigned int len, unsigned char fcp[], unsigned int *fcp_len);
+
+static RESPONSECODE FsTreeSelectPath(_fs_tree *tree, unsigned int len,
+	unsigned char fcp[], unsigned int *fcp_len);
+
+static void FsTreeEmit(_fs_tree *tree, unsigned int depth,
+	const unsigned char fcp[], unsigned int fcp_len);
+
+static RESPONSECODE FsTreeWalk(_fs_tree *tree, unsigned int depth);
+
+
+/*****************************************************************************
+ *
+ *					FsTreeSend
+ *
+ *  send a SELECT FILE, fcp gets the FCP if the SW is 90 00
+ ****************************************************************************/
+static RESPONSECODE FsTreeSend(_fs_tree *tree, const unsigned char apdu[],
+	unsigned int len, unsigned char fcp[], unsigned int *fcp_len)
+{
+	unsigned char resp[RESP_BUF_SIZE];
+	unsigned int resp_length = sizeof(resp);
+	RESPONSECODE r;
+
+	*fcp_len = 0;
+
+	/* the answer is translated by CmdXfrBlock */
+	r = CmdXfrBlock(tree->reader_index, len, (unsigned char *)apdu,
+		&resp_length, resp, T_0);
+	if (r != IFD_SUCCESS)
+		return r;
+	if (resp_length < sizeof(tree->sw))
+		return IFD_COMMUNICATION_ERROR;
+
+	resp_length -= sizeof(tree->sw);
+	memcpy(tree->sw, resp + resp_length, sizeof(tree->sw));
+	if (0x90 == tree->sw[0] && 0x00 == tree->sw[1])
+	{
+		memcpy(fcp, resp, resp_length);
+		*fcp_len = resp_length;
+	}
+
+	return IFD_SUCCESS;
+} /* FsTreeSend */
+
+
+/*****************************************************************************
+ *
+ *					FsTreeSelectPath
+ *
+ *  select the file of the first len identifiers of the path
+ ****************************************************************************/
+static RESPONSECODE FsTreeSelectPath(_fs_tree *tree, unsigned int len,
+	unsigned char fcp[], unsigned int *fcp_len)
+{
+	unsigned char apdu[5 + 2 * FS_TREE_MAX_PATH];
+	unsigned int i, n = 0;
+
+	apdu[0] = 0x00;
+	apdu[1] = 0xA4;
+	apdu[3] = 0x00;
+
+	if (1 == len)
+	{
+		/* the MF by file identifier */
+		apdu[2] = 0x00;
+		apdu[4] = 2;
+		apdu[5] = FID_MF >> 8;
+		apdu[6] = FID_MF & 0xFF;
+		n = 7;
+	}
+	else
+	{
+		/* by path from the MF */
+		apdu[2] = 0x08;
+		apdu[4] = 2 * (len - 1);
+		for (i = 1, n = 5; i < len; i++)
+		{
+			apdu[n++] = tree->path[i] >> 8;
+			apdu[n++] = tree->path[i] & 0xFF;
+		}
+	}
+
+	return FsTreeSend(tree, apdu, n, fcp, fcp_len);
+} /* FsTreeSelectPath */
+
+
+/*****************************************************************************
+ *
+ *					FsTreeEmit
+ *
+ *  append the record of a file
+ ****************************************************************************/
+static void FsTreeEmit(_fs_tree *tree, unsigned int depth,
+	const unsigned char fcp[], unsigned int fcp_len)
+{
+	const unsigned char *fid;
+
+	fid = fcp_find_tag(fcp, fcp_len, FCP_TAG_FILE_ID, 2);
+	if (NULL == fid)
+		return;
+
+	if (FS_TREE_REC_HDR_LEN + fcp_len > tree->out_size - tree->out_used)
+	{
+		tree->result = FS_TREE_RESULT_OVERFLOW;
+		return;
+	}
+
+	tree->out[tree->out_used++] = depth;
+	tree->out[tree->out_used++] = fid[0];
+	tree->out[tree->out_used++] = fid[1];
+	tree->out[tree->out_used++] = fcp_len;
+	memcpy(tree->out + tree->out_used, fcp, fcp_len);
+	tree->out_used += fcp_len;
+} /* FsTreeEmit */
+
+
+/*****************************************************************************
+ *
+ *					FsTreeWalk
+ *
+ *  append the records of the children of the current DF, whose path is
+ *  the first depth + 1 identifiers of tree->path, and of their subtrees
+ *
+ *  The 4 bytes SELECT FILE (P2 00: first, 02: next) lists the children
+ *  of the current DF. The EF are recorded as they are listed. Listing
+ *  a DF makes it current, so the DF are walked once the listing is
+ *  over.
+ ****************************************************************************/
+static RESPONSECODE FsTreeWalk(_fs_tree *tree, unsigned int depth)
+{
+	unsigned char apdu[4] = { 0x00, 0xA4, 0x00, 0x00 };
+	unsigned char fcp[RESP_BUF_SIZE];
+	unsigned int fcp_len;
+	unsigned short dfs[FS_TREE_MAX_DF_CHILDREN];
+	unsigned int ndfs = 0, i;
+	const unsigned char *fid, *type;
+	RESPONSECODE r;
+
+	for (i = 0; i < FS_TREE_MAX_CHILDREN; i++)
+	{
+		apdu[3] = i ? 0x02 : 0x00;
+		r = FsTreeSend(tree, apdu, sizeof(apdu), fcp, &fcp_len);
+		if (r != IFD_SUCCESS)
+			return r;
+
+		/* no more children */
+		if (0x6A == tree->sw[0] && 0x82 == tree->sw[1])
+			break;
+
+		if (0 == fcp_len)
+		{
+			tree->result = FS_TREE_RESULT_SW_ERROR;
+			return IFD_SUCCESS;
+		}
+
+		fid = fcp_find_tag(fcp, fcp_len, FCP_TAG_FILE_ID, 2);
+		type = fcp_find_tag(fcp, fcp_len, FCP_TAG_FILE_TYPE, 2);
+		if (NULL == fid || NULL == type)
+			continue;
+
+		if (type[0] != FILE_TYPE_DF)
+			FsTreeEmit(tree, depth + 1, fcp, fcp_len);
+		else if (ndfs < FS_TREE_MAX_DF_CHILDREN)
+			dfs[ndfs++] = (fid[0] << 8) | fid[1];
+		else
+			tree->truncated = TRUE;
+
+		if (tree->result != FS_TREE_RESULT_END)
+			return IFD_SUCCESS;
+	}
+	if (FS_TREE_MAX_CHILDREN == i)
+		tree->truncated = TRUE;
+
+	for (i = 0; i < ndfs; i++)
+	{
+		if (depth + 2 > FS_TREE_MAX_PATH)
+		{
+			tree->truncated = TRUE;
+			break;
+		}
+
+		tree->path[depth + 1] = dfs[i];
+		r = FsTreeSelectPath(tree, depth + 2, fcp, &fcp_len);
+		if (r != IFD_SUCCESS)
+			return r;
+		if (0 == fcp_len)
+		{
+			tree->result = FS_TREE_RESULT_SW_ERROR;
+			return IFD_SUCCESS;
+		}
+
+		FsTreeEmit(tree, depth + 1, fcp, fcp_len);
+		if (tree->result != FS_TREE_RESULT_END)
+			return IFD_SUCCESS;
+
+		if (depth + 1 < tree->max_depth)
+		{
+			r = FsTreeWalk(tree, depth + 1);
+			if (r != IFD_SUCCESS || tree->result != FS_TREE_RESULT_END)
+				return r;
+		}
+		else
+			tree->truncated = TRUE;
+	}
+
+	return IFD_SUCCESS;
+} /* FsTreeWalk */
+
+
+/*****************************************************************************
+ *
+ *					FsTreeRun
+ *
+ ****************************************************************************/
+RESPONSECODE FsTreeRun(unsigned int reader_index,
+	const unsigned char in[], unsigned int in_length,
+	unsigned char out[], unsigned int *out_length)
+{
+	_fs_tree tree;
+	unsigned char fcp[RESP_BUF_SIZE];
+	unsigned int out_size = *out_length;
+	unsigned int fcp_len, len, i;
+	const unsigned char *type;
+	RESPONSECODE r;
+
+	*out_length = 0;
+
+	if (in_length < FS_TREE_IN_HDR_LEN || !(in_length & 1))
+		return IFD_COMMUNICATION_ERROR;
+
+	memset(&tree, 0, sizeof(tree));
+	tree.reader_index = reader_index;
+	tree.out = out;
+	tree.out_size = out_size;
+	tree.out_used = FS_TREE_OUT_HDR_LEN;
+	tree.result = FS_TREE_RESULT_END;
+	if (tree.out_size < FS_TREE_OUT_HDR_LEN)
+		return IFD_COMMUNICATION_ERROR;
+
+	len = (in_length - 1) / 2;
+	if (len > FS_TREE_MAX_PATH)
+		return IFD_COMMUNICATION_ERROR;
+	for (i = 0; i < len; i++)
+		tree.path[i] = (in[1 + 2 * i] << 8) | in[2 + 2 * i];
+	if (tree.path[0] != FID_MF)
+		return IFD_COMMUNICATION_ERROR;
+
+	/* depth of the deepest files recorded, the MF is at depth 0 */
+	tree.max_depth = FS_TREE_MAX_PATH - 1;
+	if (in[0] && len - 1 + in[0] < tree.max_depth)
+		tree.max_depth = len - 1 + in[0];
+
+	r = FsTreeSelectPath(&tree, len, fcp, &fcp_len);
+	if (r != IFD_SUCCESS)
+		return r;
+
+	if (0 == fcp_len)
+		tree.result = FS_TREE_RESULT_SW_ERROR;
+	else
+	{
+		FsTreeEmit(&tree, len - 1, fcp, fcp_len);
+		type = fcp_find_tag(fcp, fcp_len, FCP_TAG_FILE_TYPE, 2);
+		if (FS_TREE_RESULT_END == tree.result && type
+			&& FILE_TYPE_DF == type[0] && len - 1 < tree.max_depth)
+		{
+			r = FsTreeWalk(&tree, len - 1);
+			if (r != IFD_SUCCESS)
+				return r;
+		}
+	}
+
+	if (FS_TREE_RESULT_END == tree.result && tree.truncated)
+		tree.result = FS_TREE_RESULT_TRUNCATED;
+
+	DEBUG_COMM3("file system snapshot of %u bytes, result %u",
+		tree.out_used, tree.result);
+
+	out[0] = tree.result;
+	out[1] = tree.sw[0];
+	out[2] = tree.sw[1];
+	*out_length = tree.out_used;
+
+	return IFD_SUCCESS;
+} /* FsTreeRun */
+
@@ -0,0 +1,35 @@
+/*
+    fstree.h: snapshot of the file system of the token
+    Copyright (C) 2012 Aktiv Co
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public License
+	along with this library; if not, write to the Free Software Foundation,
+	Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#ifndef FSTREE_H
+#define FSTREE_H
+
+/* Longest path from the MF (MF included) */
+#define FS_TREE_MAX_PATH	8
+/* Most children listed per DF */
+#define FS_TREE_MAX_CHILDREN	256
+/* Most DF children walked per DF */
+#define FS_TREE_MAX_DF_CHILDREN	32
+
+RESPONSECODE FsTreeRun(unsigned int reader_index,
+	const unsigned char in[], unsigned int in_length,
+	unsigned char out[], unsigned int *out_length);
+
+#endif
@@ -21,6 +21,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <arpa/inet.h>
 #include "misc.h"
 #include "config.h"
@@ -31,29 +32,53 @@
 #include "infopath.h"
 #include "rutokens.h"
 #include "defs.h"
+#include "readers.h"
 #include "rutokens_usb.h"
 #include "debug.h"
 #include "utils.h"
 #include "commands.h"
 #include "parser.h"
+#include "script.h"
+#include "stream.h"
+#include "doenum.h"
+#include "entropy.h"
+#include "fanout.h"
+#include "fstree.h"
+#include "template.h"
+#include "stats.h"
+#include "apdu.h"
+#include "instructions.h"
+#include "cache.h"
+#include "rutokens_ctl.h"
 
 #ifdef HAVE_PTHREAD
 #include <pthread.h>
 #endif
 
-/* Array of structures to hold the ATR and other state value of each slot */
-static DevDesc DevSlots[DRIVER_MAX_READERS];
-
 /* global mutex */
 #ifdef HAVE_PTHREAD
 static pthread_mutex_t ifdh_context_mutex = PTHREAD_MUTEX_INITIALIZER;
 #endif
 
 int LogLevel = 0;
+#ifdef HAVE___THREAD
+__thread int LogThreadLevel = -1;
+#else
+int LogThreadLevel = -1;
+#endif
 static int DebugInitialized = FALSE;
 
+/* a control code may act on the reader of another Lun */
+static int CrossReaderControl = FALSE;
+
+/* SCARD_ATTR_RUTOKENS_LOG_LEVEL may go above ifdLogLevel */
+static int LogLevelRaise = FALSE;
+
 /* local functions */
 static void init_driver(void);
+static void PowerDownExpire(int reader_index);
+static unsigned int *TuningValue(int reader_index, DWORD Tag,
+	unsigned int *min, unsigned int *max);
 
 
 EXTERNAL RESPONSECODE IFDHCreateChannelByName(DWORD Lun, LPSTR lpcDevice)
@@ -64,17 +89,18 @@ EXTERNAL RESPONSECODE IFDHCreateChannelByName(DWORD Lun, LPSTR lpcDevice)
 	if (!DebugInitialized)
 		init_driver();
 
+	LogLun(Lun);
 	DEBUG_INFO3("lun: %X, device: %s", Lun, lpcDevice);
 
 	if (-1 == (reader_index = GetNewReaderIndex(Lun)))
 		return IFD_COMMUNICATION_ERROR;
 
 	/* Reset ATR buffer */
-	DevSlots[reader_index].nATRLength = 0;
-	*DevSlots[reader_index].pcATRBuffer = '\0';
+	Readers[reader_index].slot.nATRLength = 0;
+	*Readers[reader_index].slot.pcATRBuffer = '\0';
 
 	/* Reset PowerFlags */
-	DevSlots[reader_index].bPowerFlags = POWERFLAGS_RAZ;
+	Readers[reader_index].slot.bPowerFlags = POWERFLAGS_RAZ;
 
 #ifdef HAVE_PTHREAD
 	pthread_mutex_lock(&ifdh_context_mutex);
@@ -113,6 +139,9 @@ EXTERNAL RESPONSECODE IFDHCreateChannelByName(DWORD Lun, LPSTR lpcDevice)
 	pthread_mutex_unlock(&ifdh_context_mutex);
 #endif
 
+	if (IFD_SUCCESS == return_value)
+		EntropyStart(reader_index);
+
 	return return_value;
 } /* IFDHCreateChannelByName */
 
@@ -158,17 +187,18 @@ EXTERNAL RESPONSECODE IFDHCreateChannel(DWORD Lun, DWORD Channel)
 	if (!DebugInitialized)
 		init_driver();
 
+	LogLun(Lun);
 	DEBUG_INFO2("lun: %X", Lun);
 
 	if (-1 == (reader_index = GetNewReaderIndex(Lun)))
 		return IFD_COMMUNICATION_ERROR;
 
 	/* Reset ATR buffer */
-	DevSlots[reader_index].nATRLength = 0;
-	*DevSlots[reader_index].pcATRBuffer = '\0';
+	Readers[reader_index].slot.nATRLength = 0;
+	*Readers[reader_index].slot.pcATRBuffer = '\0';
 
 	/* Reset PowerFlags */
-	DevSlots[reader_index].bPowerFlags = POWERFLAGS_RAZ;
+	Readers[reader_index].slot.bPowerFlags = POWERFLAGS_RAZ;
 
 #ifdef HAVE_PTHREAD
 	pthread_mutex_lock(&ifdh_context_mutex);
@@ -187,6 +217,9 @@ EXTERNAL RESPONSECODE IFDHCreateChannel(DWORD Lun, DWORD Channel)
 	pthread_mutex_unlock(&ifdh_context_mutex);
 #endif
 
+	if (IFD_SUCCESS == return_value)
+		EntropyStart(reader_index);
+
 	return return_value;
 } /* IFDHCreateChannel */
 
@@ -205,17 +238,25 @@ EXTERNAL RESPONSECODE IFDHCloseChannel(DWORD Lun)
 	 */
 	int reader_index;
 
+	LogLun(Lun);
 	DEBUG_INFO2("lun: %X", Lun);
 
 	if (-1 == (reader_index = LunToReaderIndex(Lun)))
 		return IFD_COMMUNICATION_ERROR;
 
+	/* wait for a fan-out using the reader */
+	ReaderLock(reader_index);
+
+	EntropyStop(reader_index);
+
 	/* Restore the default timeout
 	 * No need to wait too long if the reader disapeared */
-	get_device_descriptor(reader_index)->readTimeout = DEFAULT_COM_READ_TIMEOUT;
+	get_device_descriptor(reader_index)->readTimeout =
+		Readers[reader_index].tuning.readTimeout;
 
 	(void)CmdPowerOff(reader_index);
 	/* No reader status check, if it failed, what can you do ? :) */
+	Readers[reader_index].slot.bPowerFlags &= ~MASK_POWERFLAGS_PDWN_DEFERRED;
 
 #ifdef HAVE_PTHREAD
 	pthread_mutex_lock(&ifdh_context_mutex);
@@ -228,6 +269,8 @@ EXTERNAL RESPONSECODE IFDHCloseChannel(DWORD Lun)
 	pthread_mutex_unlock(&ifdh_context_mutex);
 #endif
 
+	ReaderUnlock(reader_index);
+
 	return IFD_SUCCESS;
 } /* IFDHCloseChannel */
 
@@ -236,24 +279,72 @@ static RESPONSECODE IFDHTimedSleep(DWORD Lun, int timeout);
 
 static RESPONSECODE IFDHSleep(DWORD Lun)
 {
-	DEBUG_INFO2("lun: %X", Lun);
-
-	//wait till thread is not cancelled
-	pthread_mutex_t count_mutex = PTHREAD_MUTEX_INITIALIZER;
-	pthread_cond_t  condition_var = PTHREAD_COND_INITIALIZER;
-
-	pthread_mutex_lock(&count_mutex);
-	pthread_cond_wait(&condition_var, &count_mutex);
-	pthread_mutex_unlock( &count_mutex );
-
-	return IFD_SUCCESS;
+	return IFDHTimedSleep(Lun, -1);
 }
 
 static RESPONSECODE IFDHTimedSleep(DWORD Lun, int timeout)
 {
-	DEBUG_INFO2("lun: %X", Lun);
-	(void) timeout;
-	return IFDHSleep(Lun);
+	int reader_index;
+	unsigned long long now;
+	unsigned int delay;
+	status_t ret;
+
+	LogLun(Lun);
+	DEBUG_INFO3("lun: %X, timeout: %d", Lun, timeout);
+
+	if (-1 == (reader_index = LunToReaderIndex(Lun)))
+		return IFD_COMMUNICATION_ERROR;
+
+	/* wake up pcscd so that IFDHICCPresence() can do a deferred power
+	 * down in time, IFDHPowerICC() wakes us up when it defers one */
+	if (Readers[reader_index].slot.bPowerFlags & MASK_POWERFLAGS_PDWN_DEFERRED)
+	{
+		now = GetTimeMs();
+		delay = (Readers[reader_index].slot.ullPowerDownTime > now)
+			? Readers[reader_index].slot.ullPowerDownTime - now : 0;
+		if (timeout < 0 || delay < (unsigned int)timeout)
+			timeout = delay;
+	}
+
+	/* the token is always present while its reader is plugged: only
+	 * its removal is an event */
+	ret = WaitUSB(reader_index, timeout);
+	if (STATUS_NO_SUCH_DEVICE == ret)
+	{
+		DEBUG_INFO2("lun: %X removed", Lun);
+		return IFD_NO_SUCH_DEVICE;
+	}
+	if (STATUS_SUCCESS == ret)
+		return IFD_SUCCESS;
+
+	/* the removal can't be seen here, just wait */
+	{
+		pthread_mutex_t count_mutex = PTHREAD_MUTEX_INITIALIZER;
+		pthread_cond_t  condition_var = PTHREAD_COND_INITIALIZER;
+		struct timespec deadline;
+
+		pthread_mutex_lock(&count_mutex);
+		if (timeout < 0)
+		{
+			//wait till thread is not cancelled
+			pthread_cond_wait(&condition_var, &count_mutex);
+		}
+		else
+		{
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_sec += timeout / 1000;
+			deadline.tv_nsec += (timeout % 1000) * 1000000;
+			if (deadline.tv_nsec >= 1000000000)
+			{
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&condition_var, &count_mutex, &deadline);
+		}
+		pthread_mutex_unlock(&count_mutex);
+	}
+
+	return IFD_SUCCESS;
 }
 
 EXTERNAL RESPONSECODE IFDHGetCapabilities(DWORD Lun, DWORD Tag,
@@ -278,6 +369,7 @@ EXTERNAL RESPONSECODE IFDHGetCapabilities(DWORD Lun, DWORD Tag,
 	 */
 	int reader_index;
 
+	LogLun(Lun);
 	DEBUG_INFO3("lun: %X, tag: 0x%X", Lun, Tag);
 
 	if (-1 == (reader_index = LunToReaderIndex(Lun)))
@@ -290,11 +382,15 @@ EXTERNAL RESPONSECODE IFDHGetCapabilities(DWORD Lun, DWORD Tag,
 			/* If Length is not zero, powerICC has been performed.
 			 * Otherwise, return NULL pointer
 			 * Buffer size is stored in *Length */
-			*Length = (*Length < DevSlots[reader_index].nATRLength) ?
-				*Length : DevSlots[reader_index].nATRLength;
+			*Length = (*Length < Readers[reader_index].slot.nATRLength) ?
+				*Length : Readers[reader_index].slot.nATRLength;
+
+			/* the ATR is only kept for a deferred power down */
+			if (Readers[reader_index].slot.bPowerFlags & MASK_POWERFLAGS_PDWN)
+				*Length = 0;
 
 			if (*Length)
-				memcpy(Value, DevSlots[reader_index].pcATRBuffer, *Length);
+				memcpy(Value, Readers[reader_index].slot.pcATRBuffer, *Length);
 			break;
 
 #ifdef HAVE_PTHREAD
@@ -346,6 +442,61 @@ EXTERNAL RESPONSECODE IFDHGetCapabilities(DWORD Lun, DWORD Tag,
 			break;
 #endif
 #endif // HAVE_PTHREAD
+		case SCARD_ATTR_RUTOKENS_LOG_LEVEL:
+			if (*Length >= 1)
+			{
+				*Length = 1;
+				Value[0] = GetReaderLogLevel(reader_index);
+			}
+			break;
+
+		case SCARD_ATTR_RUTOKENS_POWER_DOWN_DELAY:
+		case SCARD_ATTR_RUTOKENS_PRESENCE_TTL:
+		case SCARD_ATTR_RUTOKENS_READ_TIMEOUT:
+		case SCARD_ATTR_RUTOKENS_BUSY_BUDGET:
+		case SCARD_ATTR_RUTOKENS_BUSY_INTERVAL:
+		case SCARD_ATTR_RUTOKENS_CACHE:
+			if (*Length >= RUTOKENS_TUNING_SIZE)
+			{
+				unsigned int value = *TuningValue(reader_index, Tag, NULL,
+					NULL);
+
+				*Length = RUTOKENS_TUNING_SIZE;
+				Value[0] = value >> 24;
+				Value[1] = value >> 16;
+				Value[2] = value >> 8;
+				Value[3] = value;
+			}
+			break;
+
+		case SCARD_ATTR_RUTOKENS_STATS:
+			if (*Length >= RUTOKENS_STATS_SIZE)
+			{
+				*Length = RUTOKENS_STATS_SIZE;
+				StatsGet(reader_index, Value);
+			}
+			break;
+
+		case SCARD_ATTR_RUTOKENS_BUSY_PROGRESS:
+			if (*Length >= BUSY_PROGRESS_SIZE)
+			{
+				_device_descriptor *device_descriptor =
+					get_device_descriptor(reader_index);
+				unsigned int steps = device_descriptor->busyProgress;
+				unsigned int time = device_descriptor->busyTime;
+
+				*Length = BUSY_PROGRESS_SIZE;
+				Value[0] = steps >> 24;
+				Value[1] = steps >> 16;
+				Value[2] = steps >> 8;
+				Value[3] = steps;
+				Value[4] = time >> 24;
+				Value[5] = time >> 16;
+				Value[6] = time >> 8;
+				Value[7] = time;
+			}
+			break;
+
 		case TAG_IFD_SLOTS_NUMBER:
 			if (*Length >= 1)
 			{
@@ -394,7 +545,7 @@ EXTERNAL RESPONSECODE IFDHGetCapabilities(DWORD Lun, DWORD Tag,
 
 
 EXTERNAL RESPONSECODE IFDHSetCapabilities(DWORD Lun, DWORD Tag,
-	/*@unused@*/ DWORD Length, /*@unused@*/ PUCHAR Value)
+	DWORD Length, PUCHAR Value)
 {
 	/*
 	 * This function should set the slot/card capabilities for a
@@ -413,11 +564,81 @@ EXTERNAL RESPONSECODE IFDHSetCapabilities(DWORD Lun, DWORD Tag,
 	 * IFD_ERROR_VALUE_READ_ONLY
 	 */
 
+	int reader_index;
+
 	/* By default, say it worked */
 
+	LogLun(Lun);
 	DEBUG_INFO3("lun: %X, tag: 0x%X", Lun, Tag);
 
-	return IFD_NOT_SUPPORTED;
+	if (-1 == (reader_index = LunToReaderIndex(Lun)))
+		return IFD_COMMUNICATION_ERROR;
+
+	switch (Tag)
+	{
+		case SCARD_ATTR_RUTOKENS_LOG_LEVEL:
+			if (Length != 1)
+				return IFD_ERROR_SET_FAILURE;
+
+			/* COMM would log the PIN of the other applications */
+			if (Value[0] != RUTOKENS_LOG_LEVEL_DRIVER && !LogLevelRaise
+				&& (Value[0] & ~LogLevel))
+			{
+				DEBUG_INFO2("LogLevel above ifdLogLevel: 0x%.4X", Value[0]);
+				return IFD_ERROR_SET_FAILURE;
+			}
+
+			SetReaderLogLevel(reader_index, (RUTOKENS_LOG_LEVEL_DRIVER
+				== Value[0]) ? -1 : Value[0]);
+			LogReader(reader_index);
+			DEBUG_INFO2("LogLevel: 0x%.4X", GetReaderLogLevel(reader_index));
+			break;
+
+		case SCARD_ATTR_RUTOKENS_POWER_DOWN_DELAY:
+		case SCARD_ATTR_RUTOKENS_PRESENCE_TTL:
+		case SCARD_ATTR_RUTOKENS_READ_TIMEOUT:
+		case SCARD_ATTR_RUTOKENS_BUSY_BUDGET:
+		case SCARD_ATTR_RUTOKENS_BUSY_INTERVAL:
+		case SCARD_ATTR_RUTOKENS_CACHE:
+			{
+				unsigned int *field, value, min, max;
+
+				if (Length != RUTOKENS_TUNING_SIZE)
+					return IFD_ERROR_SET_FAILURE;
+
+				field = TuningValue(reader_index, Tag, &min, &max);
+				value = (Value[0] << 24) | (Value[1] << 16)
+					| (Value[2] << 8) | Value[3];
+				if (value < min || value > max)
+				{
+					DEBUG_CRITICAL2("Invalid tuning value: %u", value);
+					return IFD_ERROR_SET_FAILURE;
+				}
+
+				*field = value;
+				DEBUG_INFO3("Tuning 0x%X: %u", Tag, value);
+
+				/* an idle reader uses the new timeout at once, a command
+				 * in progress when it is over */
+				if (ReaderTryLock(reader_index))
+				{
+					_device_descriptor *device_descriptor =
+						get_device_descriptor(reader_index);
+
+					device_descriptor->readTimeout =
+						Readers[reader_index].tuning.readTimeout;
+					device_descriptor->busyBudget =
+						Readers[reader_index].tuning.busyBudget;
+					ReaderUnlock(reader_index);
+				}
+			}
+			break;
+
+		default:
+			return IFD_NOT_SUPPORTED;
+	}
+
+	return IFD_SUCCESS;
 } /* IFDHSetCapabilities */
 
 
@@ -445,6 +666,7 @@ EXTERNAL RESPONSECODE IFDHSetProtocolParameters(DWORD Lun, DWORD Protocol,
 
 	int reader_index;
 
+	LogLun(Lun);
 	DEBUG_INFO3("lun: %X, protocol T=%d", Lun, Protocol-1);
 
 	if (-1 == (reader_index = LunToReaderIndex(Lun)))
@@ -500,6 +722,7 @@ EXTERNAL RESPONSECODE IFDHPowerICC(DWORD Lun, DWORD Action,
 	int reader_index;
 	const char *actions[] = { "PowerUp", "PowerDown", "Reset" };
 
+	LogLun(Lun);
 	DEBUG_INFO3("lun: %X, action: %s", Lun, actions[Action-IFD_POWER_UP]);
 
 	/* By default, assume it won't work :) */
@@ -508,15 +731,34 @@ EXTERNAL RESPONSECODE IFDHPowerICC(DWORD Lun, DWORD Action,
 	if (-1 == (reader_index = LunToReaderIndex(Lun)))
 		return IFD_COMMUNICATION_ERROR;
 
+	ReaderLock(reader_index);
+
+	PowerDownExpire(reader_index);
+
 	switch (Action)
 	{
 		case IFD_POWER_DOWN:
-			/* Clear ATR buffer */
-			DevSlots[reader_index].nATRLength = 0;
-			*DevSlots[reader_index].pcATRBuffer = '\0';
-
 			/* Memorise the request */
-			DevSlots[reader_index].bPowerFlags |= MASK_POWERFLAGS_PDWN;
+			Readers[reader_index].slot.bPowerFlags |= MASK_POWERFLAGS_PDWN;
+
+			/* Keep the card powered in case it is powered up again soon */
+			if (Readers[reader_index].tuning.powerDownDelay
+				&& (Readers[reader_index].slot.bPowerFlags & MASK_POWERFLAGS_PUP))
+			{
+				DEBUG_INFO2("PowerDown deferred for %u ms",
+					Readers[reader_index].tuning.powerDownDelay);
+				Readers[reader_index].slot.bPowerFlags
+					|= MASK_POWERFLAGS_PDWN_DEFERRED;
+				Readers[reader_index].slot.ullPowerDownTime = GetTimeMs()
+					+ Readers[reader_index].tuning.powerDownDelay;
+				/* the poller must wait no longer than the delay */
+				WakeUSB(reader_index);
+				break;
+			}
+
+			/* Clear ATR buffer */
+			Readers[reader_index].slot.nATRLength = 0;
+			*Readers[reader_index].slot.pcATRBuffer = '\0';
 
 			/* send the command */
 			if (IFD_SUCCESS != CmdPowerOff(reader_index))
@@ -528,6 +770,32 @@ EXTERNAL RESPONSECODE IFDHPowerICC(DWORD Lun, DWORD Action,
 			break;
 
 		case IFD_POWER_UP:
+			/* The card is still powered since our last power up (or its
+			 * power down is deferred): no need to power cycle it, the ATR
+			 * is the same */
+			if ((Readers[reader_index].slot.bPowerFlags & MASK_POWERFLAGS_PUP)
+				&& (!(Readers[reader_index].slot.bPowerFlags & MASK_POWERFLAGS_PDWN)
+					|| (Readers[reader_index].slot.bPowerFlags
+						& MASK_POWERFLAGS_PDWN_DEFERRED))
+				&& Readers[reader_index].slot.nATRLength > 0)
+			{
+				unsigned char presence;
+
+				if (IFD_SUCCESS == CmdIccPresence(reader_index, &presence)
+					&& DEV_ICC_PRESENT_ACTIVE
+						== (presence & DEV_ICC_STATUS_MASK))
+				{
+					DEBUG_INFO("Card already powered, ATR from cache");
+					Readers[reader_index].slot.bPowerFlags &=
+						~(MASK_POWERFLAGS_PDWN | MASK_POWERFLAGS_PDWN_DEFERRED);
+					*AtrLength = Readers[reader_index].slot.nATRLength;
+					memcpy(Atr, Readers[reader_index].slot.pcATRBuffer,
+						*AtrLength);
+					break;
+				}
+			}
+			/* no break */
+
 		case IFD_RESET:
 			nlength = sizeof(pcbuffer);
 			if (CmdPowerOn(reader_index, &nlength, pcbuffer)
@@ -539,14 +807,19 @@ EXTERNAL RESPONSECODE IFDHPowerICC(DWORD Lun, DWORD Action,
 			}
 
 			/* Power up successful, set state variable to memorise it */
-			DevSlots[reader_index].bPowerFlags |= MASK_POWERFLAGS_PUP;
-			DevSlots[reader_index].bPowerFlags &= ~MASK_POWERFLAGS_PDWN;
+			Readers[reader_index].slot.bPowerFlags |= MASK_POWERFLAGS_PUP;
+			Readers[reader_index].slot.bPowerFlags &=
+				~(MASK_POWERFLAGS_PDWN | MASK_POWERFLAGS_PDWN_DEFERRED
+					| MASK_POWERFLAGS_RESYNC);
 
 			/* Reset is returned, even if TCK is wrong */
-			DevSlots[reader_index].nATRLength = *AtrLength =
+			Readers[reader_index].slot.nATRLength = *AtrLength =
 				(nlength < MAX_ATR_SIZE) ? nlength : MAX_ATR_SIZE;
 			memcpy(Atr, pcbuffer, *AtrLength);
-			memcpy(DevSlots[reader_index].pcATRBuffer, pcbuffer, *AtrLength);
+			memcpy(Readers[reader_index].slot.pcATRBuffer, pcbuffer, *AtrLength);
+
+			/* the token is fresh, no GET CHALLENGE can disturb a client */
+			EntropyFill(reader_index);
 			break;
 
 		default:
@@ -554,6 +827,7 @@ EXTERNAL RESPONSECODE IFDHPowerICC(DWORD Lun, DWORD Action,
 			return_value = IFD_NOT_SUPPORTED;
 	}
 end:
+	ReaderUnlock(reader_index);
 
 	return return_value;
 } /* IFDHPowerICC */
@@ -601,14 +875,31 @@ EXTERNAL RESPONSECODE IFDHTransmitToICC(DWORD Lun, SCARD_IO_HEADER SendPci,
 	unsigned int rx_length;
 	int reader_index;
 
+	LogLun(Lun);
 	DEBUG_INFO2("lun: %X", Lun);
 
 	if (-1 == (reader_index = LunToReaderIndex(Lun)))
 		return IFD_COMMUNICATION_ERROR;
 
+	ReaderLock(reader_index);
+
+	PowerDownExpire(reader_index);
+
+	/* the token was power cycled by a cancel, IFDHICCPresence() tells
+	 * pcscd before the application goes on */
+	if (Readers[reader_index].slot.bPowerFlags & MASK_POWERFLAGS_RESYNC)
+	{
+		DEBUG_INFO("Card reset by a cancel");
+		ReaderUnlock(reader_index);
+		*RxLength = 0;
+		return IFD_ICC_NOT_PRESENT;
+	}
+
 	rx_length = *RxLength;
 	return_value = CmdXfrBlock(reader_index, TxLength, TxBuffer, &rx_length,
 		RxBuffer, SendPci.Protocol);
+
+	ReaderUnlock(reader_index);
 	if (IFD_SUCCESS == return_value)
 		*RxLength = rx_length;
 	else
@@ -636,8 +927,12 @@ EXTERNAL RESPONSECODE IFDHControl(DWORD Lun, DWORD dwControlCode,
 	 *
 	 * Notes: RxLength should be zero on error.
 	 */
+	RESPONSECODE return_value = IFD_SUCCESS;
+	unsigned int rx_length;
 	int reader_index;
+	int locked;
 
+	LogLun(Lun);
 	DEBUG_INFO3("lun: %X, ControlCode: 0x%X", Lun, dwControlCode);
 	DEBUG_INFO_XXD("Control TxBuffer: ", TxBuffer, TxLength);
 
@@ -645,10 +940,124 @@ EXTERNAL RESPONSECODE IFDHControl(DWORD Lun, DWORD dwControlCode,
 	if ((-1 == reader_index) || (NULL == pdwBytesReturned))
 		return IFD_COMMUNICATION_ERROR;
 
-	/* No special features */
+	/* Set the return length to 0 to avoid problems */
 	*pdwBytesReturned = 0;
 
-	return IFD_SUCCESS;
+	/* a cancel or a read of the counters must not wait for the command
+	 * in flight and a fan-out locks the readers it uses */
+	locked = (dwControlCode != IOCTL_RUTOKENS_CANCEL)
+		&& (dwControlCode != IOCTL_RUTOKENS_STATS)
+		&& (dwControlCode != IOCTL_RUTOKENS_FAN_OUT);
+	if (locked)
+	{
+		ReaderLock(reader_index);
+		PowerDownExpire(reader_index);
+	}
+
+	switch (dwControlCode)
+	{
+		case IOCTL_RUTOKENS_RUN_SCRIPT:
+			rx_length = RxLength;
+			return_value = ScriptRun(reader_index, TxBuffer, TxLength,
+				RxBuffer, &rx_length);
+			if (IFD_SUCCESS == return_value)
+				*pdwBytesReturned = rx_length;
+			break;
+
+		case IOCTL_RUTOKENS_STREAM:
+			rx_length = RxLength;
+			return_value = StreamRun(reader_index, TxBuffer, TxLength,
+				RxBuffer, &rx_length);
+			if (IFD_SUCCESS == return_value)
+				*pdwBytesReturned = rx_length;
+			break;
+
+		case IOCTL_RUTOKENS_ENUM_DO:
+			rx_length = RxLength;
+			return_value = DoEnumRun(reader_index, TxBuffer, TxLength,
+				RxBuffer, &rx_length);
+			if (IFD_SUCCESS == return_value)
+				*pdwBytesReturned = rx_length;
+			break;
+
+		case IOCTL_RUTOKENS_FS_TREE:
+			rx_length = RxLength;
+			return_value = FsTreeRun(reader_index, TxBuffer, TxLength,
+				RxBuffer, &rx_length);
+			if (IFD_SUCCESS == return_value)
+				*pdwBytesReturned = rx_length;
+			break;
+
+		case IOCTL_RUTOKENS_TEMPLATE_LOAD:
+			rx_length = RxLength;
+			return_value = TemplateLoad(TxBuffer, TxLength, RxBuffer,
+				&rx_length);
+			if (IFD_SUCCESS == return_value)
+				*pdwBytesReturned = rx_length;
+			break;
+
+		case IOCTL_RUTOKENS_TEMPLATE_APPLY:
+			rx_length = RxLength;
+			return_value = TemplateApply(reader_index, TxBuffer, TxLength,
+				RxBuffer, &rx_length);
+			if (IFD_SUCCESS == return_value)
+				*pdwBytesReturned = rx_length;
+			break;
+
+		case IOCTL_RUTOKENS_FAN_OUT:
+			rx_length = RxLength;
+			return_value = FanOutRun(CrossReaderControl ? -1 : reader_index,
+				TxBuffer, TxLength, RxBuffer, &rx_length, PowerDownExpire);
+			if (IFD_SUCCESS == return_value)
+				*pdwBytesReturned = rx_length;
+			break;
+
+		case IOCTL_RUTOKENS_ENTROPY:
+			rx_length = RxLength;
+			return_value = EntropyDrain(reader_index, TxBuffer, TxLength,
+				RxBuffer, &rx_length);
+			if (IFD_SUCCESS == return_value)
+				*pdwBytesReturned = rx_length;
+			break;
+
+		case IOCTL_RUTOKENS_STATS:
+			rx_length = RxLength;
+			return_value = StatsRun(reader_index, TxBuffer, TxLength,
+				RxBuffer, &rx_length);
+			if (IFD_SUCCESS == return_value)
+				*pdwBytesReturned = rx_length;
+			break;
+
+		case IOCTL_RUTOKENS_CANCEL:
+			if (4 == TxLength)
+				reader_index = LunToReaderIndex((TxBuffer[0] << 24)
+					| (TxBuffer[1] << 16) | (TxBuffer[2] << 8) | TxBuffer[3]);
+			else if (TxLength != 0)
+				reader_index = -1;
+			if (reader_index != -1 && reader_index != LunToReaderIndex(Lun)
+				&& !CrossReaderControl)
+			{
+				DEBUG_INFO("Cancel on another reader not allowed");
+				reader_index = -1;
+			}
+			if ((-1 == reader_index) || (RxLength < 1))
+			{
+				return_value = IFD_COMMUNICATION_ERROR;
+				break;
+			}
+			RxBuffer[0] = CmdCancel(reader_index);
+			*pdwBytesReturned = 1;
+			break;
+
+		default:
+			/* No other special features */
+			break;
+	}
+
+	if (locked)
+		ReaderUnlock(reader_index);
+
+	return return_value;
 } /* IFDHControl */
 
 
@@ -664,11 +1073,12 @@ EXTERNAL RESPONSECODE IFDHICCPresence(DWORD Lun)
 
 	unsigned char presence;
 	RESPONSECODE return_value = IFD_COMMUNICATION_ERROR;
-	int oldLogLevel;
 	int reader_index;
 	_device_descriptor *device_descriptor;
 	unsigned int oldReadTimeout;
+	int locked = FALSE;
 
+	LogLun(Lun);
 	DEBUG_PERIODIC2("lun: %X", Lun);
 
 	if (-1 == (reader_index = LunToReaderIndex(Lun)))
@@ -676,27 +1086,58 @@ EXTERNAL RESPONSECODE IFDHICCPresence(DWORD Lun)
 
 	device_descriptor = get_device_descriptor(reader_index);
 
-	/* save the current read timeout computed from card capabilities */
-	oldReadTimeout = device_descriptor->readTimeout;
+	/* the status of the last transfer is used while it is recent or
+	 * while another thread talks to the token, pcscd must not wait for
+	 * a long command. A deferred power down or a resync needs the
+	 * reader. */
+	if ((!(Readers[reader_index].slot.bPowerFlags
+				& (MASK_POWERFLAGS_PDWN_DEFERRED | MASK_POWERFLAGS_RESYNC))
+			&& CmdIccPresenceShadow(reader_index,
+				Readers[reader_index].tuning.presenceTTL, &presence))
+		|| !(locked = ReaderTryLock(reader_index)))
+	{
+		if (!locked)
+			presence = device_descriptor->presence;
+		return_value = IFD_SUCCESS;
+	}
+	else
+	{
+		PowerDownExpire(reader_index);
+
+		/* save the current read timeout computed from card capabilities */
+		oldReadTimeout = device_descriptor->readTimeout;
 
-	/* use default timeout since the reader may not be present anymore */
-	device_descriptor->readTimeout = DEFAULT_COM_READ_TIMEOUT;
+		/* use default timeout since the reader may not be present anymore */
+		device_descriptor->readTimeout = Readers[reader_index].tuning.readTimeout;
 
-	/* if DEBUG_LEVEL_PERIODIC is not set we remove DEBUG_LEVEL_COMM */
-	oldLogLevel = LogLevel;
-	if (! (LogLevel & DEBUG_LEVEL_PERIODIC))
-		LogLevel &= ~DEBUG_LEVEL_COMM;
+		/* if DEBUG_LEVEL_PERIODIC is not set we remove DEBUG_LEVEL_COMM,
+		 * for this thread only */
+		if (! (LOG_LEVEL & DEBUG_LEVEL_PERIODIC))
+			LogThreadLevel = LOG_LEVEL & ~DEBUG_LEVEL_COMM;
 
-	return_value = CmdIccPresence(reader_index, &presence);
+		return_value = CmdIccPresence(reader_index, &presence);
 
-	/* set back the old timeout */
-	device_descriptor->readTimeout = oldReadTimeout;
+		/* set back the old timeout */
+		device_descriptor->readTimeout = oldReadTimeout;
 
-	/* set back the old LogLevel */
-	LogLevel = oldLogLevel;
+		/* set back the LogLevel of the reader */
+		LogReader(reader_index);
+	}
 
 	if (return_value != IFD_SUCCESS)
+	{
+		if (locked)
+			ReaderUnlock(reader_index);
 		return return_value;
+	}
+
+	/* a token power cycled by CmdResync() is reported removed once, so
+	 * that pcscd powers it up again and its applications see a reset */
+	if (locked && (Readers[reader_index].slot.bPowerFlags & MASK_POWERFLAGS_RESYNC))
+	{
+		DEBUG_INFO("Card reset by a cancel, reported removed");
+		presence = DEV_ICC_ABSENT;
+	}
 
 	return_value = IFD_COMMUNICATION_ERROR;
 	switch (presence & DEV_ICC_STATUS_MASK)	/* bStatus */
@@ -707,17 +1148,24 @@ EXTERNAL RESPONSECODE IFDHICCPresence(DWORD Lun)
 			break;
 
 		case DEV_ICC_ABSENT:
-			/* Reset ATR buffer */
-			DevSlots[reader_index].nATRLength = 0;
-			*DevSlots[reader_index].pcATRBuffer = '\0';
+			/* the slot state belongs to the thread using the reader */
+			if (locked)
+			{
+				/* Reset ATR buffer */
+				Readers[reader_index].slot.nATRLength = 0;
+				*Readers[reader_index].slot.pcATRBuffer = '\0';
 
-			/* Reset PowerFlags */
-			DevSlots[reader_index].bPowerFlags = POWERFLAGS_RAZ;
+				/* Reset PowerFlags */
+				Readers[reader_index].slot.bPowerFlags = POWERFLAGS_RAZ;
+			}
 
 			return_value = IFD_ICC_NOT_PRESENT;
 			break;
 	}
 
+	if (locked)
+		ReaderUnlock(reader_index);
+
 	DEBUG_PERIODIC2("Card %s",
 		IFD_ICC_PRESENT == return_value ? "present" : "absent");
 
@@ -725,6 +1173,85 @@ EXTERNAL RESPONSECODE IFDHICCPresence(DWORD Lun)
 } /* IFDHICCPresence */
 
 
+/*
+ * Do the power down deferred by IFDHPowerICC() once its delay is over
+ */
+static void PowerDownExpire(int reader_index)
+{
+	if (!(Readers[reader_index].slot.bPowerFlags & MASK_POWERFLAGS_PDWN_DEFERRED)
+		|| GetTimeMs() < Readers[reader_index].slot.ullPowerDownTime)
+		return;
+
+	DEBUG_INFO("Deferred PowerDown");
+	Readers[reader_index].slot.bPowerFlags &= ~MASK_POWERFLAGS_PDWN_DEFERRED;
+
+	/* Clear ATR buffer */
+	Readers[reader_index].slot.nATRLength = 0;
+	*Readers[reader_index].slot.pcATRBuffer = '\0';
+
+	/* the token state cache is dropped by CmdPowerOff() */
+	if (IFD_SUCCESS != CmdPowerOff(reader_index))
+		DEBUG_CRITICAL("PowerDown failed");
+} /* PowerDownExpire */
+
+
+/*
+ * Tuning value of a reader changed by a SCARD_ATTR_RUTOKENS_* attribute
+ * and its allowed range
+ */
+static unsigned int *TuningValue(int reader_index, DWORD Tag,
+	unsigned int *min, unsigned int *max)
+{
+	_reader_tuning *tuning = &Readers[reader_index].tuning;
+	unsigned int *field;
+	unsigned int lo = 0, hi = 0xFFFFFFFF;
+
+	switch (Tag)
+	{
+		case SCARD_ATTR_RUTOKENS_POWER_DOWN_DELAY:
+			/* the security state outlives a deferred power down, only
+			 * Info.plist may keep it longer */
+			field = &tuning->powerDownDelay;
+			hi = DriverTuning.powerDownDelay;
+			break;
+
+		case SCARD_ATTR_RUTOKENS_PRESENCE_TTL:
+			field = &tuning->presenceTTL;
+			break;
+
+		case SCARD_ATTR_RUTOKENS_READ_TIMEOUT:
+			/* the int timeout of usb_control_msg() */
+			field = &tuning->readTimeout;
+			lo = 1;
+			hi = INT_MAX;
+			break;
+
+		case SCARD_ATTR_RUTOKENS_BUSY_BUDGET:
+			field = &tuning->busyBudget;
+			lo = 1;
+			break;
+
+		case SCARD_ATTR_RUTOKENS_BUSY_INTERVAL:
+			field = &tuning->busyInterval;
+			lo = 1;
+			hi = 1000;
+			break;
+
+		default:
+			field = &tuning->cache;
+			hi = 1;
+			break;
+	}
+
+	if (min)
+		*min = lo;
+	if (max)
+		*max = hi;
+
+	return field;
+} /* TuningValue */
+
+
 void init_driver(void)
 {
 	char keyValue[TOKEN_MAX_VALUE_SIZE];
@@ -757,8 +1284,52 @@ void init_driver(void)
 	DEBUG_INFO("Driver version: " VERSION);
 	DEBUG_INFO2("LogLevel: 0x%.4X", LogLevel);
 
+	/* Power down delay */
+	if (0 == LTPBundleFindValueWithKey(infofile, "ifdPowerDownDelay",
+		keyValue, 0))
+	{
+		DriverTuning.powerDownDelay = strtoul(keyValue, NULL, 0);
+		/* IFDHTimedSleep() waits for it in an int */
+		if (DriverTuning.powerDownDelay > INT_MAX)
+			DriverTuning.powerDownDelay = INT_MAX;
+		DEBUG_INFO2("PowerDownDelay: %u ms", DriverTuning.powerDownDelay);
+	}
+
+	/* control codes on the reader of another Lun */
+	if (0 == LTPBundleFindValueWithKey(infofile, "ifdCrossReaderControl",
+		keyValue, 0))
+	{
+		CrossReaderControl = strtoul(keyValue, NULL, 0) != 0;
+		DEBUG_INFO2("CrossReaderControl: %d", CrossReaderControl);
+	}
+
+	/* log level of a reader above ifdLogLevel */
+	if (0 == LTPBundleFindValueWithKey(infofile, "ifdLogLevelRaise",
+		keyValue, 0))
+	{
+		LogLevelRaise = strtoul(keyValue, NULL, 0) != 0;
+		DEBUG_INFO2("LogLevelRaise: %d", LogLevelRaise);
+	}
+
+	/* Presence from the last token status */
+	if (0 == LTPBundleFindValueWithKey(infofile, "ifdPresenceTTL",
+		keyValue, 0))
+	{
+		DriverTuning.presenceTTL = strtoul(keyValue, NULL, 0);
+		DEBUG_INFO2("PresenceTTL: %u ms", DriverTuning.presenceTTL);
+	}
+
+	/* DF/EF whose content may be cached */
+	CacheInit(infofile);
+
+	/* timeout and busy budget of some commands */
+	InstructionInit(infofile);
+
 	/* initialise the Lun to reader_index mapping */
 	InitReaderIndex();
 
+	/* random bytes read at power up */
+	EntropyInit(infofile);
+
 	DebugInitialized = TRUE;
 } /* init_driver */
@@ -0,0 +1,388 @@
+/*
+    instructions.c: Rutoken S specific handling of each instruction
+    Copyright (C) 2012 Aktiv Co
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public License
+	along with this library; if not, write to the Free Software Foundation,
+	Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include <stdio.h>
+#include <string.h>
+#include <pcsclite.h>
+#include <ifdhandler.h>
+
+#include "misc.h"
+#include "config.h"
+#include "debug.h"
+#include "apdu.h"
+#include "convert_apdu.h"
+#include "instructions.h"
+#include "cache.h"
+#include "parser.h"
+
+#define ARRAY_SIZE(a)	(sizeof(a) / sizeof((a)[0]))
+
+/* internal functions */
+
+static int TxSwapPair(unsigned char data[], unsigned int lc);
+
+static int TxFcpToRtprot(unsigned char data[], unsigned int lc);
+
+static int TxDoInfoToRtprot(unsigned char data[], unsigned int lc);
+
+static int RxRtprotToFcp(unsigned char data[], unsigned int len,
+	unsigned int size);
+
+static int RxRtprotToDoInfo(unsigned char data[], unsigned int len,
+	unsigned int size);
+
+static int RxSwapPair(unsigned char data[], unsigned int len,
+	unsigned int size);
+
+static int RxSwapFour(unsigned char data[], unsigned int len,
+	unsigned int size);
+
+/*
+ * Instructions needing a special handling, sorted by INS. The entries of
+ * the same INS are contiguous, the most specific first.
+ */
+static const _instruction Instructions[] =
+{
+	/* erase binary */
+	{ 0x00, 0x0e, 0x00, 0x80, 0x00, 0x00,
+		0, 0, NULL, NULL, NULL, CacheWriteBinaryUpdate },
+	/* erase binary, short EF identifier */
+	{ 0x00, 0x0e, 0x80, 0x80, 0x00, 0x00,
+		INS_CHANGES_CONTENT, 0, NULL, NULL, NULL, NULL },
+
+	/* verify, the retry counter is part of the DO info */
+	{ 0x00, 0x20, 0x00, 0x00, 0x00, 0x00,
+		INS_KEEPS_CURRENT_FILE | INS_CHANGES_DO_INFO, 0,
+		NULL, NULL, NULL, NULL },
+
+	/* manage security environment */
+	{ 0x00, 0x22, 0x00, 0x00, 0x00, 0x00,
+		INS_KEEPS_CURRENT_FILE, 0, NULL, NULL, NULL, NULL },
+
+	/* change reference data */
+	{ 0x00, 0x24, 0x00, 0x00, 0x00, 0x00,
+		INS_KEEPS_CURRENT_FILE | INS_CHANGES_DO_INFO, 0,
+		NULL, NULL, NULL, NULL },
+
+	/* perform security operation */
+	{ 0x00, 0x2a, 0x00, 0x00, 0x00, 0x00,
+		INS_KEEPS_CURRENT_FILE, 0, NULL, NULL, NULL, NULL },
+
+	/* reset retry counter */
+	{ 0x00, 0x2c, 0x00, 0x00, 0x00, 0x00,
+		INS_KEEPS_CURRENT_FILE | INS_CHANGES_DO_INFO, 0,
+		NULL, NULL, NULL, NULL },
+
+	/* get_do_info */
+	{ 0x80, 0x30, 0x00, 0x00, 0x00, 0x00,
+		INS_KEEPS_CURRENT_FILE, 0xff, NULL, RxRtprotToDoInfo,
+		CacheDoInfoLookup, CacheDoInfoUpdate },
+
+	/* get challenge */
+	{ 0x00, 0x84, 0x00, 0x00, 0x00, 0x00,
+		INS_KEEPS_CURRENT_FILE, 0, NULL, NULL, NULL, NULL },
+
+	/* select file, the current file is tracked by the cache hook */
+	{ 0x00, 0xa4, 0x00, 0x00, 0x00, 0x00,
+		INS_KEEPS_CURRENT_FILE | INS_GET_RESPONSE | INS_FORCE_CASE_2, 0x20,
+		TxSwapPair, RxRtprotToFcp, CacheSelectLookup, CacheSelectUpdate },
+
+	/* read binary */
+	{ 0x00, 0xb0, 0x00, 0x80, 0x00, 0x00,
+		INS_KEEPS_CURRENT_FILE, 0, NULL, NULL,
+		CacheReadBinaryLookup, CacheReadBinaryUpdate },
+	/* read binary, short EF identifier */
+	{ 0x00, 0xb0, 0x80, 0x80, 0x00, 0x00,
+		0, 0, NULL, NULL, NULL, NULL },
+
+	/* get_serial */
+	{ 0x00, 0xca, 0x01, 0xff, 0x81, 0xff,
+		INS_KEEPS_CURRENT_FILE, 0, NULL, RxSwapFour,
+		CacheGetDataLookup, CacheGetDataUpdate },
+	/* get_free_mem */
+	{ 0x00, 0xca, 0x01, 0xff, 0x8a, 0xff,
+		INS_KEEPS_CURRENT_FILE, 0, NULL, RxSwapFour,
+		CacheGetDataLookup, CacheGetDataUpdate },
+	/* get_current_ef */
+	{ 0x00, 0xca, 0x01, 0xff, 0x11, 0xff,
+		INS_KEEPS_CURRENT_FILE, 0, NULL, RxSwapPair, NULL, NULL },
+	/* get data */
+	{ 0x00, 0xca, 0x00, 0x00, 0x00, 0x00,
+		INS_KEEPS_CURRENT_FILE, 0, NULL, NULL, NULL, NULL },
+
+	/* write binary */
+	{ 0x00, 0xd0, 0x00, 0x80, 0x00, 0x00,
+		0, 0, NULL, NULL, NULL, CacheWriteBinaryUpdate },
+	/* write binary, short EF identifier */
+	{ 0x00, 0xd0, 0x80, 0x80, 0x00, 0x00,
+		INS_CHANGES_CONTENT, 0, NULL, NULL, NULL, NULL },
+
+	/* update binary */
+	{ 0x00, 0xd6, 0x00, 0x80, 0x00, 0x00,
+		INS_KEEPS_CURRENT_FILE, 0, NULL, NULL, NULL, CacheWriteBinaryUpdate },
+	/* update binary, short EF identifier */
+	{ 0x00, 0xd6, 0x80, 0x80, 0x00, 0x00,
+		INS_CHANGES_CONTENT, 0, NULL, NULL, NULL, NULL },
+
+	/* create_do */
+	{ 0x00, 0xda, 0x01, 0xff, 0x62, 0xff,
+		INS_KEEPS_CURRENT_FILE | INS_CHANGES_MEMORY | INS_CHANGES_DO_INFO, 0,
+		TxDoInfoToRtprot, NULL, NULL, NULL },
+	/* key_gen */
+	{ 0x00, 0xda, 0x01, 0xff, 0x65, 0xff,
+		INS_KEEPS_CURRENT_FILE | INS_CHANGES_MEMORY | INS_CHANGES_DO_INFO, 0,
+		TxDoInfoToRtprot, NULL, NULL, NULL },
+	/* put data */
+	{ 0x00, 0xda, 0x00, 0x00, 0x00, 0x00,
+		INS_KEEPS_CURRENT_FILE | INS_CHANGES_MEMORY | INS_CHANGES_DO_INFO, 0,
+		NULL, NULL, NULL, NULL },
+
+	/* create file */
+	{ 0x00, 0xe0, 0x00, 0x00, 0x00, 0x00,
+		INS_CHANGES_MEMORY | INS_CHANGES_DO_INFO | INS_CHANGES_CONTENT, 0,
+		TxFcpToRtprot, NULL, NULL, NULL },
+
+	/* delete file */
+	{ 0x00, 0xe4, 0x00, 0x00, 0x00, 0x00,
+		INS_CHANGES_MEMORY | INS_CHANGES_DO_INFO | INS_CHANGES_CONTENT, 0,
+		TxSwapPair, NULL, NULL, NULL },
+};
+
+/* 1 + index in Instructions[] of the first entry of each INS, 0 if none,
+ * built by InstructionInit() */
+static unsigned char InstructionIndex[256];
+
+/* Any other interindustry command: the current file may change */
+static const _instruction InterindustryDefault =
+{
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0, 0, NULL, NULL, NULL, NULL
+};
+
+/* Any other proprietary command: anything may change */
+static const _instruction ProprietaryDefault =
+{
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	INS_CHANGES_MEMORY | INS_CHANGES_DO_INFO | INS_CHANGES_CONTENT, 0,
+	NULL, NULL, NULL, NULL
+};
+
+/* Timeout and busy budget of the commands listed in Info.plist */
+static _instruction_profile Profiles[INSTRUCTION_MAX_PROFILES];
+static int ProfileCount = 0;
+
+
+/*****************************************************************************
+ *
+ *					TxSwapPair
+ *
+ *  select file, delete file: file identifiers are little endian
+ ****************************************************************************/
+static int TxSwapPair(unsigned char data[], unsigned int lc)
+{
+	swap_pair(data, lc);
+
+	return lc;
+} /* TxSwapPair */
+
+
+/*****************************************************************************
+ *
+ *					TxFcpToRtprot
+ *
+ ****************************************************************************/
+static int TxFcpToRtprot(unsigned char data[], unsigned int lc)
+{
+	int len;
+
+	len = convert_fcp_to_rtprot(data, lc);
+	DEBUG_COMM2("convert_fcp_to_rtprot = %i", len);
+
+	return len;
+} /* TxFcpToRtprot */
+
+
+/*****************************************************************************
+ *
+ *					TxDoInfoToRtprot
+ *
+ ****************************************************************************/
+static int TxDoInfoToRtprot(unsigned char data[], unsigned int lc)
+{
+	int len;
+
+	len = convert_doinfo_to_rtprot(data, lc);
+	DEBUG_COMM2("convert_doinfo_to_rtprot = %i", len);
+
+	return len;
+} /* TxDoInfoToRtprot */
+
+
+/*****************************************************************************
+ *
+ *					RxRtprotToFcp
+ *
+ ****************************************************************************/
+static int RxRtprotToFcp(unsigned char data[], unsigned int len,
+	unsigned int size)
+{
+	/* size of rtprot */
+	if (len != 32)
+		return -1;
+
+	len = convert_rtprot_to_fcp(data, size);
+	DEBUG_COMM2("convert_rtprot_to_fcp = %i", len);
+
+	return len;
+} /* RxRtprotToFcp */
+
+
+/*****************************************************************************
+ *
+ *					RxRtprotToDoInfo
+ *
+ ****************************************************************************/
+static int RxRtprotToDoInfo(unsigned char data[], unsigned int len,
+	unsigned int size)
+{
+	/* size of rtprot */
+	if (len < 32)
+		return -1;
+
+	len = convert_rtprot_to_doinfo(data, size);
+	DEBUG_COMM2("convert_rtprot_to_doinfo = %i", len);
+
+	return len;
+} /* RxRtprotToDoInfo */
+
+
+/*****************************************************************************
+ *
+ *					RxSwapPair
+ *
+ ****************************************************************************/
+static int RxSwapPair(unsigned char data[], unsigned int len,
+	unsigned int size)
+{
+	(void)size;
+	swap_pair(data, len);
+
+	return len;
+} /* RxSwapPair */
+
+
+/*****************************************************************************
+ *
+ *					RxSwapFour
+ *
+ ****************************************************************************/
+static int RxSwapFour(unsigned char data[], unsigned int len,
+	unsigned int size)
+{
+	(void)size;
+	swap_four(data, len);
+
+	return len;
+} /* RxSwapFour */
+
+
+/*****************************************************************************
+ *
+ *					InstructionFind
+ *
+ *  return how to handle the command, never NULL
+ ****************************************************************************/
+const _instruction *InstructionFind(const ifd_iso_apdu_t *iso)
+{
+	unsigned int i;
+	const _instruction *ins;
+
+	for (i = InstructionIndex[iso->ins]; i > 0 && i <= ARRAY_SIZE(Instructions)
+		&& Instructions[i - 1].ins == iso->ins; i++)
+	{
+		ins = &Instructions[i - 1];
+		if (ins->cla == iso->cla
+			&& (iso->p1 & ins->p1_mask) == ins->p1
+			&& (iso->p2 & ins->p2_mask) == ins->p2)
+			return ins;
+	}
+
+	return (0 == iso->cla) ? &InterindustryDefault : &ProprietaryDefault;
+} /* InstructionFind */
+
+
+/*****************************************************************************
+ *
+ *					InstructionInit
+ *
+ *  index the instructions and read their profiles from Info.plist
+ ****************************************************************************/
+void InstructionInit(const char infofile[])
+{
+	char keyValue[TOKEN_MAX_VALUE_SIZE];
+	unsigned int cla, ins, timeout, busy, n;
+	int i;
+
+	/* the first entry of each INS, the entries of an INS must follow it */
+	for (n = ARRAY_SIZE(Instructions); n > 0; n--)
+		InstructionIndex[Instructions[n - 1].ins] = n;
+	for (n = 1; n < ARRAY_SIZE(Instructions); n++)
+		if (Instructions[n].ins != Instructions[n - 1].ins
+			&& InstructionIndex[Instructions[n].ins] != n + 1)
+			DEBUG_CRITICAL3("Instructions[%u]: INS 0x%02X is not contiguous",
+				n, Instructions[n].ins);
+
+	for (i = 0; ProfileCount < INSTRUCTION_MAX_PROFILES
+		&& 0 == LTPBundleFindValueWithKey(infofile, "ifdInstructionProfile",
+			keyValue, i); i++)
+	{
+		if (4 != sscanf(keyValue, "%x %x %u %u", &cla, &ins, &timeout, &busy)
+			|| cla > 0xFF || ins > 0xFF || 0 == timeout || 0 == busy)
+		{
+			DEBUG_CRITICAL2("Invalid ifdInstructionProfile: %s", keyValue);
+			continue;
+		}
+
+		Profiles[ProfileCount].cla = cla;
+		Profiles[ProfileCount].ins = ins;
+		Profiles[ProfileCount].timeout = timeout;
+		Profiles[ProfileCount].busy = busy;
+		DEBUG_INFO2("Instruction profile enabled: %s", keyValue);
+		ProfileCount++;
+	}
+} /* InstructionInit */
+
+
+/*****************************************************************************
+ *
+ *					InstructionProfileFind
+ *
+ *  return the profile of the command or NULL to use the default one
+ ****************************************************************************/
+const _instruction_profile *InstructionProfileFind(const ifd_iso_apdu_t *iso)
+{
+	int i;
+
+	for (i = 0; i < ProfileCount; i++)
+		if (Profiles[i].cla == iso->cla && Profiles[i].ins == iso->ins)
+			return &Profiles[i];
+
+	return NULL;
+} /* InstructionProfileFind */
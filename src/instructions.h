@@ -0,0 +1,105 @@
+/*
+    instructions.h: Rutoken S specific handling of each instruction
+    Copyright (C) 2012 Aktiv Co
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public License
+	along with this library; if not, write to the Free Software Foundation,
+	Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#ifndef INSTRUCTIONS_H
+#define INSTRUCTIONS_H
+
+/* The command does not change the current file */
+#define INS_KEEPS_CURRENT_FILE	0x01
+/* The command may change the free memory of the token */
+#define INS_CHANGES_MEMORY		0x02
+/* The command may change the answer of a get_do_info */
+#define INS_CHANGES_DO_INFO		0x04
+/* The command may change the content of any EF */
+#define INS_CHANGES_CONTENT		0x08
+/* The answer is read with GET RESPONSE even for a case 2 or 3 command */
+#define INS_GET_RESPONSE		0x10
+/* A case 1 command is sent as a case 2 command */
+#define INS_FORCE_CASE_2		0x20
+
+/* Number of instruction profiles read from Info.plist */
+#define INSTRUCTION_MAX_PROFILES	32
+
+typedef struct
+{
+	unsigned char cla;
+	unsigned char ins;
+	unsigned char p1, p1_mask;
+	unsigned char p2, p2_mask;
+
+	/* INS_* */
+	unsigned int flags;
+
+	/*
+	 * Le sent to the token instead of the command one, 0 if none
+	 */
+	unsigned char le;
+
+	/*
+	 * Translate the command data in place, return the new length or -1 to
+	 * send the data unchanged. data is CMD_BUF_SIZE bytes long.
+	 */
+	int (*tx)(unsigned char data[], unsigned int lc);
+
+	/*
+	 * Translate the answer data (without SW) of a successful command in
+	 * place, return the new length or -1 to keep the answer unchanged.
+	 * The buffer is size bytes long.
+	 */
+	int (*rx)(unsigned char data[], unsigned int len, unsigned int size);
+
+	/*
+	 * Answer the command from the token state cache
+	 * return TRUE if the command must not be sent
+	 */
+	int (*lookup)(unsigned int reader_index, const ifd_iso_apdu_t *iso,
+		unsigned char rx_buffer[], unsigned int *rx_length);
+
+	/*
+	 * Learn from the translated answer, rx_length is 0 if the command
+	 * failed
+	 */
+	void (*update)(unsigned int reader_index, const ifd_iso_apdu_t *iso,
+		const unsigned char rx_buffer[], unsigned int rx_length);
+} _instruction;
+
+typedef struct
+{
+	unsigned char cla;
+	unsigned char ins;
+
+	/*
+	 * Read timeout of each transfer in milliseconds
+	 */
+	unsigned int timeout;
+
+	/*
+	 * Busy status polls without progress of the token
+	 */
+	unsigned int busy;
+} _instruction_profile;
+
+void InstructionInit(const char infofile[]);
+
+const _instruction *InstructionFind(const ifd_iso_apdu_t *iso);
+
+const _instruction_profile *InstructionProfileFind(const ifd_iso_apdu_t *iso);
+
+#endif
@@ -56,6 +56,18 @@ extern "C"
 #define min(a,b) (((a) < (b)) ? (a) : (b))
 #endif
 
+/*
+ * Size of a cache line. Data written by different threads is kept on
+ * different cache lines so that they don't share (and bounce) a line.
+ */
+#define CACHE_LINE 64
+
+#if defined __GNUC__
+#define CACHE_ALIGNED __attribute__ ((aligned(CACHE_LINE)))
+#else
+#define CACHE_ALIGNED
+#endif
+
 #ifdef __cplusplus
 }
 #endif
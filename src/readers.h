@@ -0,0 +1,181 @@
+/*
+    readers.h: state of each reader
+    Copyright (C) 2012 Aktiv Co
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public License
+	along with this library; if not, write to the Free Software Foundation,
+	Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+
+#ifndef READERS_H
+#define READERS_H
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+struct usb_dev_handle;
+
+/*
+ * Tuning of a reader, copied from DriverTuning when the reader is opened
+ * and changed at run time with SCardSetAttrib()
+ */
+typedef struct
+{
+	/*
+	 * Delay in ms before a power down is really done (0: no delay)
+	 */
+	unsigned int powerDownDelay;
+
+	/*
+	 * Age in ms of a token status still used for its presence
+	 */
+	unsigned int presenceTTL;
+
+	/*
+	 * Read timeout in ms and busy budget of the commands without an
+	 * instruction profile
+	 */
+	unsigned int readTimeout;
+	unsigned int busyBudget;
+
+	/*
+	 * Delay in ms between two busy status polls
+	 */
+	unsigned int busyInterval;
+
+	/*
+	 * Commands are answered from the read cache
+	 */
+	unsigned int cache;
+} _reader_tuning;
+
+/* latency buckets of 2^i ms, see IOCTL_RUTOKENS_STATS */
+#define STATS_LATENCY_BUCKETS	16
+
+/*
+ * Counters of a reader since it was opened, only written while the
+ * reader is locked
+ */
+typedef struct
+{
+	/*
+	 * APDUs transmitted and the ones answered from the read cache
+	 */
+	unsigned int apdus;
+	unsigned int cacheHits;
+
+	/*
+	 * USB control transfers, and the ones done to send the APDUs
+	 */
+	unsigned int transfers;
+	unsigned int apduTransfers;
+
+	/*
+	 * Busy status polls and time in ms spent waiting for a busy token
+	 */
+	unsigned int busyPolls;
+	unsigned int busyTime;
+
+	/*
+	 * APDUs sent to the token which failed or were cancelled
+	 */
+	unsigned int errors;
+	unsigned int cancels;
+
+	/*
+	 * Latency in ms of the APDUs sent to the token
+	 */
+	unsigned int latencyMax;
+	unsigned int latency[STATS_LATENCY_BUCKETS];
+} _reader_stats;
+
+typedef struct
+{
+	/*
+	 * Identity of the reader, only written when the reader is opened
+	 * or closed. Every call reads the Lun of all the readers.
+	 */
+
+	/*
+	 * Lun given by pcscd, -1 if the reader is not used
+	 */
+	int lun;
+
+	/*
+	 * LogLevel of the reader, -1 to use the driver LogLevel
+	 */
+	int logLevel;
+
+	/*
+	 * USB device
+	 */
+	struct usb_dev_handle *handle;
+	char *dirname;
+	char *filename;
+	int interface;
+
+	/*
+	 * usbfs node of the device polled for its removal, -1 if not open
+	 */
+	int poll_fd;
+
+	/*
+	 * pipe written to end a wait on poll_fd early, -1 if not open
+	 */
+	int wake_fd[2];
+
+	/*
+	 * Tuning, read by every command
+	 */
+	_reader_tuning tuning;
+
+	/*
+	 * Token, its part written by every command starts a cache line
+	 */
+	_device_descriptor desc;
+
+	/*
+	 * Counters, written by every command
+	 */
+	_reader_stats stats;
+
+	/*
+	 * ATR and power state of the slot
+	 */
+	DevDesc slot;
+
+#ifdef HAVE_PTHREAD
+	/*
+	 * pcscd only serializes the calls to one reader, the driver itself
+	 * may talk to several readers at once (fan-out)
+	 */
+	pthread_mutex_t lock;
+#endif
+
+	/*
+	 * Buffer of the translated command, so that no memory is allocated
+	 * to send an APDU
+	 */
+	unsigned char txScratch[CMD_BUF_SIZE];
+} _reader;
+
+/* _reader is aligned on cache lines: two readers never share a line */
+extern _reader Readers[DRIVER_MAX_READERS];
+
+/* tuning of the new readers, from Info.plist */
+extern _reader_tuning DriverTuning;
+
+#endif
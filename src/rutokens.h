@@ -28,11 +28,14 @@
 
 typedef struct
 {
+	/*
+	 * Identity of the token, written when its reader is opened
+	 */
+
 	/*
 	 * Sequence number
 	 */
-	unsigned char *pbSeq;
-	unsigned char real_bSeq;
+	unsigned char bSeq;
 
 	/*
 	 * VendorID << 16 + ProductID
@@ -54,17 +57,50 @@ typedef struct
 	 */
 	char bMaxSlotIndex;
 
+	/*
+	 * bNumEndpoints
+	 */
+	int bNumEndpoints;
+
+	/*
+	 * State of the exchanges with the token, written by every command:
+	 * it starts on its own cache line
+	 */
+
 	/*
 	 * Read communication port timeout
-	 * value is seconds
+	 * value is milliseconds
 	 * this value can evolve dynamically if card request it (time processing).
 	 */
-	unsigned int readTimeout;
+	unsigned int readTimeout CACHE_ALIGNED;
 
 	/*
-	 * bNumEndpoints
+	 * Number of busy status polls in a row without progress of the token
+	 * before the command is given up
+	 * this value can evolve dynamically with the command sent.
 	 */
-	int bNumEndpoints;
+	unsigned int busyBudget;
+
+	/*
+	 * Last completed busy wait: steps of the token counter and duration
+	 * in milliseconds
+	 */
+	unsigned int busyProgress;
+	unsigned int busyTime;
+
+	/*
+	 * inFlight is set while a command is exchanged with the token.
+	 * cancelled is set by another thread to abort it.
+	 */
+	volatile int inFlight;
+	volatile int cancelled;
+
+	/*
+	 * Presence (DEV_ICC_*) seen by the last status read of the token
+	 * and its GetTimeMs() date, 0 if the presence is not known
+	 */
+	volatile unsigned char presence;
+	volatile unsigned long long presenceTime;
 
 } _device_descriptor;
 
@@ -0,0 +1,423 @@
+/*
+    rutokens_ctl.h: Vendor control codes accepted by IFDHControl
+    Copyright (C) 2012 Aktiv Co
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public License
+	along with this library; if not, write to the Free Software Foundation,
+	Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/*
+ * This file only contains defines and may be included by applications
+ * using SCardControl() to talk to the driver.
+ */
+
+#ifndef RUTOKENS_CTL_H
+#define RUTOKENS_CTL_H
+
+#ifndef SCARD_CTL_CODE
+#define SCARD_CTL_CODE(code) (0x42000000 + (code))
+#endif
+
+#ifndef SCARD_ATTR_VALUE
+#define SCARD_ATTR_VALUE(Class, Tag) ((((unsigned long)(Class)) << 16) | ((unsigned long)(Tag)))
+#endif
+
+#ifndef SCARD_CLASS_VENDOR_DEFINED
+#define SCARD_CLASS_VENDOR_DEFINED 7
+#endif
+
+/*
+ * IOCTL_RUTOKENS_RUN_SCRIPT
+ *
+ * Run a small APDU script inside the driver. Later commands may depend
+ * on the responses of earlier ones without a round trip to the
+ * application.
+ *
+ * TxBuffer: budget_hi budget_lo step...
+ *   budget is the maximum number of steps executed (0: default budget).
+ *
+ * Steps (all 16 bits values are big endian):
+ *   END                                  stop, script succeeded
+ *   FAIL                                 stop, script failed
+ *   APDU  flags len apdu[len] n (offset reg width){n}
+ *                                        send the APDU after copying the
+ *                                        1 or 2 low bytes of register reg
+ *                                        at the given offset
+ *   LOAD  reg offset width               reg = response data[offset..]
+ *   SET   reg hi lo                      reg = value
+ *   MOV   dst src                        dst = src
+ *   ADD   dst src                        dst += src
+ *   SUB   dst src                        dst -= src (0 if src > dst)
+ *   MIN   dst src                        dst = min(dst, src)
+ *   JSW   sw1 sw2 mask1 mask2 hi lo      jump if (SW & mask) == sw
+ *   JNSW  sw1 sw2 mask1 mask2 hi lo      jump if (SW & mask) != sw
+ *   JNZ   reg hi lo                      jump if reg != 0
+ *   JMP   hi lo                          jump
+ *   Jump targets are byte offsets of a step from the start of the
+ *   first step.
+ *
+ * RxBuffer: result sw1 sw2 collected...
+ *   result is one of SCRIPT_RESULT_*, sw1 sw2 is the status word of
+ *   the last APDU sent and collected is the concatenation of the
+ *   response data (without SW) of the APDUs flagged SCRIPT_APDU_COLLECT.
+ */
+#define IOCTL_RUTOKENS_RUN_SCRIPT	SCARD_CTL_CODE(3501)
+
+#define SCRIPT_OP_END		0x00
+#define SCRIPT_OP_APDU		0x01
+#define SCRIPT_OP_LOAD		0x02
+#define SCRIPT_OP_SET		0x03
+#define SCRIPT_OP_MOV		0x04
+#define SCRIPT_OP_ADD		0x05
+#define SCRIPT_OP_SUB		0x06
+#define SCRIPT_OP_MIN		0x07
+#define SCRIPT_OP_JSW		0x08
+#define SCRIPT_OP_JNSW		0x09
+#define SCRIPT_OP_JNZ		0x0A
+#define SCRIPT_OP_JMP		0x0B
+#define SCRIPT_OP_FAIL		0x0C
+
+/* APDU step flags */
+#define SCRIPT_APDU_COLLECT		0x01	/* append response data to RxBuffer */
+#define SCRIPT_APDU_STOP_ON_ERROR	0x02	/* stop if SW is not 90 00 */
+
+/* Number of 16 bits registers */
+#define SCRIPT_REGISTERS	8
+
+/* Script results */
+#define SCRIPT_RESULT_END		0x00	/* END step reached */
+#define SCRIPT_RESULT_FAIL		0x01	/* FAIL step reached */
+#define SCRIPT_RESULT_SW_ERROR		0x02	/* stopped by SCRIPT_APDU_STOP_ON_ERROR */
+#define SCRIPT_RESULT_BUDGET		0x03	/* step budget exhausted */
+#define SCRIPT_RESULT_OVERFLOW		0x04	/* RxBuffer too short for collected data */
+
+/*
+ * IOCTL_RUTOKENS_CANCEL
+ *
+ * Abort the command in flight on a reader. The command fails and the
+ * token is powered off and on, so its security state is lost. The next
+ * IFDHTransmitToICC() on the reader fails and pcscd is told the token
+ * was removed, so every application of the reader sees a reset card.
+ *
+ * pcscd serializes the calls to a reader, so the control code is sent
+ * through another reader of the driver to abort a command on a busy
+ * one. This ignores the sharing and the transactions of pcscd on the
+ * aborted reader and is refused unless ifdCrossReaderControl is set in
+ * Info.plist.
+ *
+ * TxBuffer: [lun[4]]
+ *   lun (big endian) of the reader whose command is aborted, the
+ *   reader of the call if absent.
+ *
+ * RxBuffer: cancelled
+ *   cancelled is 1 if a command was in flight, 0 otherwise.
+ */
+#define IOCTL_RUTOKENS_CANCEL	SCARD_CTL_CODE(3502)
+
+/*
+ * IOCTL_RUTOKENS_STREAM
+ *
+ * Send long data to the token in chained commands (hash, cipher, ...)
+ * without a round trip to the application for each chunk.
+ *
+ * TxBuffer: flags cla ins p1 p2 chunk data...
+ *   data is sent in case 3 commands of chunk bytes (0: default size)
+ *   with the given header. Every command but the last one has the
+ *   chaining bit (0x10) set in its class byte. The stream stops at the
+ *   first SW other than 90 00.
+ *   Data longer than a single call allows is sent in several calls,
+ *   all of them but the last one flagged STREAM_MORE.
+ *
+ * RxBuffer: sw1 sw2 output...
+ *   sw1 sw2 is the status word of the last command sent and output is
+ *   the concatenation of the response data (without SW) of the
+ *   commands, if STREAM_COLLECT or STREAM_LE is set.
+ */
+#define IOCTL_RUTOKENS_STREAM	SCARD_CTL_CODE(3503)
+
+/* Stream flags */
+#define STREAM_MORE		0x01	/* the stream goes on in the next call */
+#define STREAM_COLLECT		0x02	/* append the response data of every command */
+#define STREAM_LE		0x04	/* the last command is sent with Le 00 and its response data is returned */
+
+/*
+ * IOCTL_RUTOKENS_ENUM_DO
+ *
+ * Get the DO info of a range of data objects in one call.
+ *
+ * TxBuffer: p1 p2 first last offset misses len data[len]
+ *   for each id from first to last, get_do_info (80 30 p1 p2) is sent
+ *   with data where the byte at offset is replaced by the id. The
+ *   enumeration stops after misses + 1 ids in a row without DO
+ *   (SW 6A 82).
+ *
+ * RxBuffer: result sw1 sw2 next (id len info[len])...
+ *   result is one of DO_ENUM_RESULT_*, sw1 sw2 is the status word of
+ *   the last get_do_info sent and next the first id not examined yet
+ *   (a call may go on from there after DO_ENUM_RESULT_OVERFLOW). next
+ *   is meaningless with DO_ENUM_RESULT_END.
+ *   Each DO found is described by its id and its DO info.
+ */
+#define IOCTL_RUTOKENS_ENUM_DO	SCARD_CTL_CODE(3504)
+
+/* DO enumeration results */
+#define DO_ENUM_RESULT_END		0x00	/* last id reached */
+#define DO_ENUM_RESULT_MISSES		0x01	/* too many ids in a row without DO */
+#define DO_ENUM_RESULT_SW_ERROR		0x02	/* SW other than 90 00 or 6A 82 */
+#define DO_ENUM_RESULT_OVERFLOW		0x03	/* RxBuffer too short for the next DO info */
+
+/*
+ * IOCTL_RUTOKENS_FS_TREE
+ *
+ * Get the FCP of every file below a DF in one call.
+ *
+ * TxBuffer: depth fid[2]...
+ *   the path from the MF (3F 00 first) of the DF or EF to start from.
+ *   depth is the number of levels walked below it (0: no limit).
+ *
+ * RxBuffer: result sw1 sw2 (depth fid[2] len fcp[len])...
+ *   result is one of FS_TREE_RESULT_*, sw1 sw2 is the status word of
+ *   the last SELECT FILE sent. Each file is recorded with its depth
+ *   (0 for the MF), its identifier and its FCP. The records are in
+ *   depth first order: the parent of a file is the last record before
+ *   it of a lesser depth.
+ *   The current file of the token is lost.
+ */
+#define IOCTL_RUTOKENS_FS_TREE	SCARD_CTL_CODE(3505)
+
+/* file system snapshot results */
+#define FS_TREE_RESULT_END		0x00	/* the whole tree is recorded */
+#define FS_TREE_RESULT_TRUNCATED	0x01	/* some DF are not walked (too deep or too many) */
+#define FS_TREE_RESULT_SW_ERROR		0x02	/* SW other than 90 00 */
+#define FS_TREE_RESULT_OVERFLOW		0x03	/* RxBuffer too short */
+
+/*
+ * IOCTL_RUTOKENS_TEMPLATE_LOAD
+ *
+ * Keep a list of commands (CREATE FILE, create_do, UPDATE BINARY, ...)
+ * in the driver, to be applied to many tokens. The command data is
+ * translated for the token once, when the template is loaded.
+ * Templates are shared by all the readers of the driver.
+ *
+ * TxBuffer: slot (flags len[2] apdu[len])...
+ *   slot is the template number, from 0 to 3. The previous template of
+ *   the slot is replaced. A slot is emptied by a template without step.
+ *   flags is a combination of TEMPLATE_STEP_*.
+ *
+ * RxBuffer: generation[4] (big endian)
+ *   generation identifies the loaded template. A client of any reader
+ *   may load another template in the slot, IOCTL_RUTOKENS_TEMPLATE_APPLY
+ *   only applies the template of this generation.
+ */
+#define IOCTL_RUTOKENS_TEMPLATE_LOAD	SCARD_CTL_CODE(3506)
+
+/*
+ * IOCTL_RUTOKENS_TEMPLATE_APPLY
+ *
+ * Send the commands of a template to the token.
+ *
+ * TxBuffer: slot generation[4]
+ *   generation is the one returned by IOCTL_RUTOKENS_TEMPLATE_LOAD.
+ *
+ * RxBuffer: result sw1 sw2 step[2]
+ *   result is one of TEMPLATE_RESULT_*, sw1 sw2 is the status word of
+ *   the last command sent and step (big endian) the index of the step
+ *   that stopped the template, or the number of steps.
+ */
+#define IOCTL_RUTOKENS_TEMPLATE_APPLY	SCARD_CTL_CODE(3507)
+
+/* Template step flags */
+#define TEMPLATE_STEP_IGNORE_SW		0x01	/* go on whatever the SW */
+
+/* Template results */
+#define TEMPLATE_RESULT_END		0x00	/* every step done */
+#define TEMPLATE_RESULT_SW_ERROR	0x01	/* stopped by a SW other than 90 00 */
+#define TEMPLATE_RESULT_EMPTY		0x02	/* no template in the slot */
+#define TEMPLATE_RESULT_REPLACED	0x03	/* the slot holds another generation, nothing sent */
+
+/*
+ * IOCTL_RUTOKENS_FAN_OUT
+ *
+ * Run the same script (see IOCTL_RUTOKENS_RUN_SCRIPT) on several tokens
+ * of the driver at once. The tokens are served in parallel, each one
+ * by a single thread. The control may be sent to any reader of the
+ * driver, its token is only used if its Lun is in the list.
+ *
+ * The scripts run on the other readers ignore the sharing and the
+ * transactions of pcscd: they may run between two commands of another
+ * application, inside its transaction. Unless ifdCrossReaderControl is
+ * set in Info.plist only the reader of the call is used, the other
+ * ones are answered FAN_OUT_STATUS_DENIED.
+ *
+ * TxBuffer: n lun[4]{n} script
+ *   n is the number of tokens, from 1 to 16, lun (big endian) the Lun
+ *   pcscd gave to the reader of each token and script the TxBuffer of
+ *   IOCTL_RUTOKENS_RUN_SCRIPT.
+ *
+ * RxBuffer: (lun[4] status len[2] output[len]){n}
+ *   One answer per token, in the order of TxBuffer. status is one of
+ *   FAN_OUT_STATUS_* and output the RxBuffer of IOCTL_RUTOKENS_RUN_SCRIPT
+ *   if status is FAN_OUT_STATUS_DONE. Each token has an equal share of
+ *   RxBuffer for its answer.
+ */
+#define IOCTL_RUTOKENS_FAN_OUT	SCARD_CTL_CODE(3508)
+
+/* Fan-out token status */
+#define FAN_OUT_STATUS_DONE		0x00	/* the script was run */
+#define FAN_OUT_STATUS_NO_READER	0x01	/* no reader with this Lun */
+#define FAN_OUT_STATUS_ERROR		0x02	/* the script could not be run */
+#define FAN_OUT_STATUS_DENIED		0x03	/* the reader is not the one of the call */
+
+/*
+ * IOCTL_RUTOKENS_ENTROPY
+ *
+ * Read random bytes generated by the token. If the ifdEntropyPool key
+ * of Info.plist is set, the driver reads them when the token is powered
+ * up and the bytes are returned without talking to the token. The
+ * missing bytes are read from the token.
+ *
+ * The bytes come from GET CHALLENGE commands but are NOT known by the
+ * token as a challenge. Never use them to authenticate to the token,
+ * send a GET CHALLENGE for this.
+ *
+ * TxBuffer: length[2] (big endian)
+ *
+ * RxBuffer: random bytes
+ */
+#define IOCTL_RUTOKENS_ENTROPY	SCARD_CTL_CODE(3509)
+
+/*
+ * IOCTL_RUTOKENS_STATS
+ *
+ * Read the counters of the reader since it was opened, to watch the
+ * health of its token. The same value is the SCardGetAttrib()
+ * attribute SCARD_ATTR_RUTOKENS_STATS.
+ *
+ * TxBuffer: empty
+ *
+ * RxBuffer: RUTOKENS_STATS_SIZE bytes, each value is 4 bytes (big endian)
+ *   apdus        APDUs of the applications, of the control codes and
+ *                of the read ahead of the cache, the cached ones
+ *                included
+ *   cache_hits   APDUs answered from the read cache (ifdReadCachePath)
+ *   transfers    USB transfers, the presence polls and the power ups
+ *                and downs included
+ *   apdu_transfers
+ *                USB transfers done to send the APDUs, busy polls
+ *                included: apdu_transfers / (apdus - cache_hits) is
+ *                the cost of an APDU sent to the token
+ *   busy_polls   status polls while the token was busy
+ *   busy_time    time in ms spent waiting for the busy token
+ *   errors       APDUs sent to the token with no answer
+ *   cancels      APDUs cancelled by IOCTL_RUTOKENS_CANCEL
+ *   p50 p90 p99  latency percentiles in ms of the APDUs sent to the
+ *                token, rounded up to the end of a latency bucket
+ *   max          highest latency in ms
+ *   latency[16]  APDUs sent to the token by latency: bucket 0 counts
+ *                the ones under 1 ms, bucket i the ones from 2^(i-1)
+ *                to 2^i - 1 ms and bucket 15 the ones of 2^14 ms or more
+ *
+ * The counters wrap around at 2^32. A monitor reading them periodically
+ * gets the percentiles of a period from the difference of the buckets.
+ */
+#define IOCTL_RUTOKENS_STATS	SCARD_CTL_CODE(3510)
+
+#define RUTOKENS_STATS_SIZE	(4 * (12 + 16))
+
+/*
+ * SCARD_ATTR_RUTOKENS_BUSY_PROGRESS
+ *
+ * SCardGetAttrib() attribute telling how the last long command went.
+ * The token is busy while it works and moves a counter at each step.
+ *
+ * Value: steps[4] time[4] (big endian)
+ *   steps and time (in milliseconds) of the last completed busy wait.
+ *   pcscd serializes SCardGetAttrib() with the commands of the reader,
+ *   so a busy wait in progress is never seen.
+ */
+#define SCARD_ATTR_RUTOKENS_BUSY_PROGRESS \
+	SCARD_ATTR_VALUE(SCARD_CLASS_VENDOR_DEFINED, 0x0101)
+
+#define BUSY_PROGRESS_SIZE	8
+
+/*
+ * SCARD_ATTR_RUTOKENS_LOG_LEVEL
+ *
+ * SCardGetAttrib()/SCardSetAttrib() attribute of the log level of one
+ * reader (see ifdLogLevel in Info.plist). It lets one token be debugged
+ * without logging the others.
+ *
+ * Value: level
+ *   level may only keep bits of ifdLogLevel, so that no application
+ *   logs the commands (PIN, ...) of the others, unless ifdLogLevelRaise
+ *   is set in Info.plist.
+ *   RUTOKENS_LOG_LEVEL_DRIVER makes the reader use ifdLogLevel again.
+ */
+#define SCARD_ATTR_RUTOKENS_LOG_LEVEL \
+	SCARD_ATTR_VALUE(SCARD_CLASS_VENDOR_DEFINED, 0x0102)
+
+#define RUTOKENS_LOG_LEVEL_DRIVER	0xFF
+
+/*
+ * Tuning of one reader
+ *
+ * SCardGetAttrib()/SCardSetAttrib() attributes changing how the driver
+ * talks to one reader while it is used, without restarting pcscd. A
+ * reader opened again gets the values of Info.plist back.
+ *
+ * Value: value[4] (big endian)
+ *
+ * SCARD_ATTR_RUTOKENS_POWER_DOWN_DELAY
+ *   ifdPowerDownDelay in milliseconds, up to the value of Info.plist
+ *   since the security state of the token outlives a deferred power
+ *   down. A power down already deferred keeps its date.
+ * SCARD_ATTR_RUTOKENS_PRESENCE_TTL
+ *   ifdPresenceTTL in milliseconds
+ * SCARD_ATTR_RUTOKENS_READ_TIMEOUT
+ *   read timeout in milliseconds of the commands without an
+ *   ifdInstructionProfile, from 1 to 2^31 - 1
+ * SCARD_ATTR_RUTOKENS_BUSY_BUDGET
+ *   busy status polls without progress of the token of the commands
+ *   without an ifdInstructionProfile, from 1
+ * SCARD_ATTR_RUTOKENS_BUSY_INTERVAL
+ *   delay in milliseconds between two busy status polls, from 1 to 1000
+ * SCARD_ATTR_RUTOKENS_CACHE
+ *   1 if commands are answered from the read cache (ifdReadCachePath),
+ *   0 if every command is sent to the token
+ */
+#define SCARD_ATTR_RUTOKENS_POWER_DOWN_DELAY \
+	SCARD_ATTR_VALUE(SCARD_CLASS_VENDOR_DEFINED, 0x0103)
+#define SCARD_ATTR_RUTOKENS_PRESENCE_TTL \
+	SCARD_ATTR_VALUE(SCARD_CLASS_VENDOR_DEFINED, 0x0104)
+#define SCARD_ATTR_RUTOKENS_READ_TIMEOUT \
+	SCARD_ATTR_VALUE(SCARD_CLASS_VENDOR_DEFINED, 0x0105)
+#define SCARD_ATTR_RUTOKENS_BUSY_BUDGET \
+	SCARD_ATTR_VALUE(SCARD_CLASS_VENDOR_DEFINED, 0x0106)
+#define SCARD_ATTR_RUTOKENS_BUSY_INTERVAL \
+	SCARD_ATTR_VALUE(SCARD_CLASS_VENDOR_DEFINED, 0x0107)
+#define SCARD_ATTR_RUTOKENS_CACHE \
+	SCARD_ATTR_VALUE(SCARD_CLASS_VENDOR_DEFINED, 0x0108)
+
+#define RUTOKENS_TUNING_SIZE	4
+
+/*
+ * SCARD_ATTR_RUTOKENS_STATS
+ *
+ * SCardGetAttrib() attribute of the counters of the reader, see
+ * IOCTL_RUTOKENS_STATS
+ */
+#define SCARD_ATTR_RUTOKENS_STATS \
+	SCARD_ATTR_VALUE(SCARD_CLASS_VENDOR_DEFINED, 0x0109)
+
+#endif
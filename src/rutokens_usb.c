@@ -24,6 +24,9 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
 # ifdef S_SPLINT_S
 # include <sys/types.h>
 # endif
@@ -36,45 +39,21 @@
 #include "config.h"
 #include "debug.h"
 #include "defs.h"
+#include "readers.h"
 #include "utils.h"
 #include "parser.h"
-
-
-typedef struct
-{
-	usb_dev_handle *handle;
-	char *dirname;
-	char *filename;
-	int interface;
-
-	/*
-	 * Endpoints
-	 */
-	int bulk_in;
-	int bulk_out;
-	int interrupt;
-
-	/* Number of slots using the same device */
-	int real_nb_opened_slots;
-	int *nb_opened_slots;
-
-	/*
-	 * Device infos common to USB
-	 */
-	_device_descriptor rtdesc;
-
-} _usbDevice;
-
-/* The _usbDevice structure must be defined before including rutokens_usb.h */
 #include "rutokens_usb.h"
 
-/* ne need to initialize to 0 since it is static */
-static _usbDevice usbDevice[DRIVER_MAX_READERS];
-
 #define PCSCLITE_MANUKEY_NAME                   "ifdVendorID"
 #define PCSCLITE_PRODKEY_NAME                   "ifdProductID"
 #define PCSCLITE_NAMEKEY_NAME                   "ifdFriendlyName"
 
+/* directories of the usbfs nodes, %s/%s is dirname/filename */
+static const char *UsbFsPaths[] = {
+	"/dev/bus/usb/%s/%s",
+	"/proc/bus/usb/%s/%s"
+};
+
 
 /*****************************************************************************
  *
@@ -249,7 +228,7 @@ again_libusb:
 	}
 
 	/* is the reader_index already used? */
-	if (usbDevice[reader_index].handle != NULL)
+	if (Readers[reader_index].handle != NULL)
 	{
 		DEBUG_CRITICAL2("USB driver with index %X already in use",
 			reader_index);
@@ -336,11 +315,11 @@ again_libusb:
 					DEBUG_COMM3("Checking device: %s/%s", bus->dirname, dev->filename);
 					for (r=0; r<DRIVER_MAX_READERS; r++)
 					{
-						if (usbDevice[r].handle)
+						if (Readers[r].handle)
 						{
-							DEBUG_COMM3("Comparing with device: %s/%s", usbDevice[r].dirname, usbDevice[r].filename);
+							DEBUG_COMM3("Comparing with device: %s/%s", Readers[r].dirname, Readers[r].filename);
 							/* same busname, same filename */
-							if (strcmp(usbDevice[r].dirname, bus->dirname) == 0 && strcmp(usbDevice[r].filename, dev->filename) == 0)
+							if (strcmp(Readers[r].dirname, bus->dirname) == 0 && strcmp(Readers[r].filename, dev->filename) == 0)
 								already_used = TRUE;
 						}
 					}
@@ -394,30 +373,47 @@ again_libusb:
 					/* No Endpoints; control only*/
 
 					/* store device information */
-					usbDevice[reader_index].handle = dev_handle;
-					usbDevice[reader_index].dirname = strdup(bus->dirname);
-					usbDevice[reader_index].filename = strdup(dev->filename);
-					usbDevice[reader_index].interface = interface;
-					usbDevice[reader_index].real_nb_opened_slots = 1;
-					usbDevice[reader_index].nb_opened_slots = &usbDevice[reader_index].real_nb_opened_slots;
+					Readers[reader_index].handle = dev_handle;
+					Readers[reader_index].dirname = strdup(bus->dirname);
+					Readers[reader_index].filename = strdup(dev->filename);
+					Readers[reader_index].interface = interface;
+					Readers[reader_index].poll_fd = -1;
+					if (pipe(Readers[reader_index].wake_fd) < 0)
+					{
+						DEBUG_CRITICAL2("pipe() failed: %s", strerror(errno));
+						Readers[reader_index].wake_fd[0] = -1;
+						Readers[reader_index].wake_fd[1] = -1;
+					}
+					else
+					{
+						/* a pending wake up is enough, never block on it */
+						fcntl(Readers[reader_index].wake_fd[0], F_SETFL, O_NONBLOCK);
+						fcntl(Readers[reader_index].wake_fd[1], F_SETFL, O_NONBLOCK);
+					}
 
 					/* Device common informations */
-					usbDevice[reader_index].rtdesc.real_bSeq = 0;
-					usbDevice[reader_index].rtdesc.pbSeq = &usbDevice[reader_index].rtdesc.real_bSeq;
-					usbDevice[reader_index].rtdesc.readerID = (dev->descriptor.idVendor << 16) + dev->descriptor.idProduct;
-
-					usbDevice[reader_index].rtdesc.dwMaxDevMessageLength = 261;
-					usbDevice[reader_index].rtdesc.dwMaxIFSD = 254;
-					usbDevice[reader_index].rtdesc.bMaxSlotIndex = 0;
-
-					usbDevice[reader_index].rtdesc.readTimeout = DEFAULT_COM_READ_TIMEOUT;
-					usbDevice[reader_index].rtdesc.bNumEndpoints = usb_interface->altsetting->bNumEndpoints;
+					Readers[reader_index].desc.bSeq = 0;
+					Readers[reader_index].desc.readerID = (dev->descriptor.idVendor << 16) + dev->descriptor.idProduct;
+
+					Readers[reader_index].desc.dwMaxDevMessageLength = 261;
+					Readers[reader_index].desc.dwMaxIFSD = 254;
+					Readers[reader_index].desc.bMaxSlotIndex = 0;
+
+					Readers[reader_index].desc.readTimeout = Readers[reader_index].tuning.readTimeout;
+					Readers[reader_index].desc.busyBudget = Readers[reader_index].tuning.busyBudget;
+					Readers[reader_index].desc.busyProgress = 0;
+					Readers[reader_index].desc.busyTime = 0;
+					Readers[reader_index].desc.inFlight = FALSE;
+					Readers[reader_index].desc.cancelled = FALSE;
+					Readers[reader_index].desc.presence = DEV_ICC_PRESENT_ACTIVE;
+					Readers[reader_index].desc.presenceTime = 0;
+					Readers[reader_index].desc.bNumEndpoints = usb_interface->altsetting->bNumEndpoints;
 				}
 			}
 		}
 	}
 end:
-	if (usbDevice[reader_index].handle == NULL) {
+	if (Readers[reader_index].handle == NULL) {
 #ifdef __APPLE__
 		// There is a race condition with libusb-1.0. The latter doesn't have time to process
 		// token connection by the usb_find_devices() call. To handle this situation there is
@@ -450,35 +446,41 @@ end:
 status_t CloseUSB(unsigned int reader_index)
 {
 	/* device not opened */
-	if (usbDevice[reader_index].handle == NULL)
+	if (Readers[reader_index].handle == NULL)
 		return STATUS_UNSUCCESSFUL;
 
 	DEBUG_COMM3("Closing USB device: %s/%s",
-		usbDevice[reader_index].dirname,
-		usbDevice[reader_index].filename);
+		Readers[reader_index].dirname,
+		Readers[reader_index].filename);
 
-	/* one slot closed */
-	(*usbDevice[reader_index].nb_opened_slots)--;
+	if (Readers[reader_index].poll_fd >= 0)
+	{
+		close(Readers[reader_index].poll_fd);
+		Readers[reader_index].poll_fd = -1;
+	}
 
-	/* release the allocated ressources for the last slot only */
-	if (0 == *usbDevice[reader_index].nb_opened_slots)
+	if (Readers[reader_index].wake_fd[0] >= 0)
 	{
-		DEBUG_COMM("Last slot closed. Release resources");
+		close(Readers[reader_index].wake_fd[0]);
+		close(Readers[reader_index].wake_fd[1]);
+		Readers[reader_index].wake_fd[0] = -1;
+		Readers[reader_index].wake_fd[1] = -1;
+	}
 
-		usb_release_interface(usbDevice[reader_index].handle,
-			usbDevice[reader_index].interface);
-		usb_close(usbDevice[reader_index].handle);
-		usb_find_devices();
+	/* the token has a single slot */
+	usb_release_interface(Readers[reader_index].handle,
+		Readers[reader_index].interface);
+	usb_close(Readers[reader_index].handle);
+	usb_find_devices();
 
-		free(usbDevice[reader_index].dirname);
-		free(usbDevice[reader_index].filename);
-	}
+	free(Readers[reader_index].dirname);
+	free(Readers[reader_index].filename);
 
 	/* mark the resource unused */
-	usbDevice[reader_index].handle = NULL;
-	usbDevice[reader_index].dirname = NULL;
-	usbDevice[reader_index].filename = NULL;
-	usbDevice[reader_index].interface = 0;
+	Readers[reader_index].handle = NULL;
+	Readers[reader_index].dirname = NULL;
+	Readers[reader_index].filename = NULL;
+	Readers[reader_index].interface = 0;
 
 	return STATUS_SUCCESS;
 } /* CloseUSB */
@@ -491,7 +493,7 @@ status_t CloseUSB(unsigned int reader_index)
  ****************************************************************************/
 _device_descriptor *get_device_descriptor(unsigned int reader_index)
 {
-	return &usbDevice[reader_index].rtdesc;
+	return &Readers[reader_index].desc;
 } /* get_device_descriptor */
 
 
@@ -534,12 +536,113 @@ int ControlUSB(int reader_index, int requesttype, int request, int value,
 	if (0 == (requesttype & 0x80))
 		DEBUG_XXD("send: ", bytes, size);
 
-	ret = usb_control_msg(usbDevice[reader_index].handle, requesttype,
-		request, value, usbDevice[reader_index].interface, (char *)bytes, size,
-		usbDevice[reader_index].rtdesc.readTimeout * 1000);
+	Readers[reader_index].stats.transfers++;
+
+	ret = usb_control_msg(Readers[reader_index].handle, requesttype,
+		request, value, Readers[reader_index].interface, (char *)bytes, size,
+		Readers[reader_index].desc.readTimeout);
 
 	if (requesttype & 0x80)
 		 DEBUG_XXD("receive: ", bytes, ret);
 
 	return ret;
 } /* ControlUSB */
+
+
+/*****************************************************************************
+ *
+ *					WaitUSB
+ *
+ *  Wait for the removal of the device, at most timeout ms (-1: forever).
+ *  No USB transfer is done, the kernel tells when the device is gone.
+ *  WakeUSB() ends the wait early.
+ *
+ *  return STATUS_NO_SUCH_DEVICE if the device is removed, STATUS_SUCCESS
+ *  at the end of the timeout or on a wake up and STATUS_UNSUCCESSFUL if
+ *  nothing can be waited for
+ ****************************************************************************/
+status_t WaitUSB(unsigned int reader_index, int timeout)
+{
+	struct pollfd pfd[2];
+	nfds_t nfds = 0;
+	char drain[16];
+	int ret;
+#ifdef __linux__
+	char path[FILENAME_MAX];
+	unsigned int i;
+#endif
+
+	if (NULL == Readers[reader_index].handle)
+		return STATUS_NO_SUCH_DEVICE;
+
+#ifdef __linux__
+	for (i=0; Readers[reader_index].poll_fd < 0
+		&& i<sizeof(UsbFsPaths)/sizeof(UsbFsPaths[0]); i++)
+	{
+		snprintf(path, sizeof(path), UsbFsPaths[i],
+			Readers[reader_index].dirname, Readers[reader_index].filename);
+		Readers[reader_index].poll_fd = open(path, O_RDONLY | O_NONBLOCK);
+		if (Readers[reader_index].poll_fd >= 0)
+			DEBUG_INFO2("Polling %s", path);
+	}
+
+	if (Readers[reader_index].poll_fd < 0)
+		DEBUG_INFO3("Can't poll USB device %s/%s",
+			Readers[reader_index].dirname, Readers[reader_index].filename);
+	else
+	{
+		/* no event asked, a usbfs node only reports its disconnection */
+		pfd[nfds].fd = Readers[reader_index].poll_fd;
+		pfd[nfds].events = 0;
+		pfd[nfds].revents = 0;
+		nfds++;
+	}
+#endif
+
+	if (Readers[reader_index].wake_fd[0] >= 0)
+	{
+		pfd[nfds].fd = Readers[reader_index].wake_fd[0];
+		pfd[nfds].events = POLLIN;
+		pfd[nfds].revents = 0;
+		nfds++;
+	}
+
+	if (0 == nfds)
+		return STATUS_UNSUCCESSFUL;
+
+	ret = poll(pfd, nfds, timeout);
+	if (ret < 0)
+	{
+		if (EINTR == errno)
+			return STATUS_SUCCESS;
+
+		DEBUG_CRITICAL2("poll() failed: %s", strerror(errno));
+		return STATUS_UNSUCCESSFUL;
+	}
+
+	if (ret > 0 && pfd[0].fd == Readers[reader_index].poll_fd
+		&& (pfd[0].revents & (POLLHUP | POLLERR | POLLNVAL)))
+		return STATUS_NO_SUCH_DEVICE;
+
+	/* several wake ups are one */
+	if (ret > 0 && (pfd[nfds-1].revents & POLLIN))
+		while (read(Readers[reader_index].wake_fd[0], drain, sizeof(drain)) > 0)
+			;
+
+	return STATUS_SUCCESS;
+} /* WaitUSB */
+
+
+/*****************************************************************************
+ *
+ *					WakeUSB
+ *
+ *  End a WaitUSB() in progress, or the next one if none is
+ ****************************************************************************/
+void WakeUSB(unsigned int reader_index)
+{
+	if (Readers[reader_index].wake_fd[1] >= 0)
+		if (write(Readers[reader_index].wake_fd[1], "", 1) < 0
+			&& errno != EAGAIN)
+			DEBUG_CRITICAL2("write() failed: %s", strerror(errno));
+} /* WakeUSB */
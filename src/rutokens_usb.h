@@ -31,6 +31,10 @@ status_t CloseUSB(unsigned int reader_index);
 
 struct usb_interface *get_usb_interface(struct usb_device *dev);
 
+status_t WaitUSB(unsigned int reader_index, int timeout);
+
+void WakeUSB(unsigned int reader_index);
+
 int ControlUSB(int reader_index, int requesttype, int request, int value,
 	unsigned char *bytes, unsigned int size);
 
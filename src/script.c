@@ -0,0 +1,284 @@
+/*
+    script.c: APDU scripts run inside the driver
+    Copyright (C) 2012 Aktiv Co
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public License
+	along with this library; if not, write to the Free Software Foundation,
+	Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include <string.h>
+#include <pcsclite.h>
+#include <ifdhandler.h>
+
+#include "misc.h"
+#include "config.h"
+#include "defs.h"
+#include "debug.h"
+#include "commands.h"
+#include "script.h"
+#include "rutokens_ctl.h"
+
+/* result + SW */
+#define SCRIPT_OUT_HDR_LEN	3
+
+/* internal functions */
+
+static int ScriptFetch(unsigned int script_length, unsigned int pc,
+	unsigned int count);
+
+static unsigned int ScriptTarget(const unsigned char *p);
+
+
+/*****************************************************************************
+ *
+ *					ScriptFetch
+ *
+ *  return TRUE if count bytes can be read at pc
+ ****************************************************************************/
+static int ScriptFetch(unsigned int script_length, unsigned int pc,
+	unsigned int count)
+{
+	return pc <= script_length && count <= script_length - pc;
+} /* ScriptFetch */
+
+
+/*****************************************************************************
+ *
+ *					ScriptTarget
+ *
+ ****************************************************************************/
+static unsigned int ScriptTarget(const unsigned char *p)
+{
+	return (p[0] << 8) | p[1];
+} /* ScriptTarget */
+
+
+/*****************************************************************************
+ *
+ *					ScriptRun
+ *
+ ****************************************************************************/
+RESPONSECODE ScriptRun(unsigned int reader_index,
+	const unsigned char script[], unsigned int script_length,
+	unsigned char out[], unsigned int *out_length)
+{
+	unsigned short reg[SCRIPT_REGISTERS];
+	unsigned char apdu[CMD_BUF_SIZE];
+	unsigned char resp[RESP_BUF_SIZE];
+	unsigned int resp_length = 0;
+	unsigned int out_size = *out_length;
+	unsigned int out_used = SCRIPT_OUT_HDR_LEN;
+	unsigned int budget, pc = 0;
+	unsigned char sw[2] = { 0, 0 };
+	unsigned char result = SCRIPT_RESULT_BUDGET;
+	const unsigned char *p;
+	RESPONSECODE r;
+
+	*out_length = 0;
+
+	if (script_length < 2 || out_size < SCRIPT_OUT_HDR_LEN)
+		return IFD_COMMUNICATION_ERROR;
+
+	budget = (script[0] << 8) | script[1];
+	if (0 == budget)
+		budget = SCRIPT_DEFAULT_BUDGET;
+	if (budget > SCRIPT_MAX_BUDGET)
+		budget = SCRIPT_MAX_BUDGET;
+
+	/* steps start after the budget */
+	script += 2;
+	script_length -= 2;
+
+	memset(reg, 0, sizeof(reg));
+
+	for (; budget > 0; budget--)
+	{
+		if (!ScriptFetch(script_length, pc, 1))
+			goto malformed;
+		p = script + pc;
+
+		switch (p[0])
+		{
+			case SCRIPT_OP_END:
+				result = SCRIPT_RESULT_END;
+				goto end;
+
+			case SCRIPT_OP_FAIL:
+				result = SCRIPT_RESULT_FAIL;
+				goto end;
+
+			case SCRIPT_OP_APDU:
+			{
+				unsigned int flags, len, n, i;
+
+				if (!ScriptFetch(script_length, pc, 3))
+					goto malformed;
+				flags = p[1];
+				len = p[2];
+				if (len < 4 || len > sizeof(apdu)
+					|| !ScriptFetch(script_length, pc + 3, len + 1))
+					goto malformed;
+				memcpy(apdu, p + 3, len);
+
+				/* register substitutions */
+				n = p[3 + len];
+				if (!ScriptFetch(script_length, pc + 4 + len, n * 3))
+					goto malformed;
+				for (i = 0; i < n; i++)
+				{
+					const unsigned char *s = p + 4 + len + i * 3;
+					unsigned int offset = s[0], rn = s[1], width = s[2];
+
+					if (rn >= SCRIPT_REGISTERS || width < 1 || width > 2
+						|| offset + width > len)
+						goto malformed;
+					if (2 == width)
+						apdu[offset++] = reg[rn] >> 8;
+					apdu[offset] = reg[rn] & 0xFF;
+				}
+
+				DEBUG_COMM3("step %u: %s", pc, array_hexdump(apdu, len));
+				resp_length = sizeof(resp);
+				r = CmdXfrBlock(reader_index, len, apdu, &resp_length, resp,
+					T_0);
+				if (r != IFD_SUCCESS)
+					return r;
+				if (resp_length < sizeof(sw))
+					return IFD_COMMUNICATION_ERROR;
+
+				/* keep the data only, the SW is stored apart */
+				resp_length -= sizeof(sw);
+				memcpy(sw, resp + resp_length, sizeof(sw));
+
+				if (flags & SCRIPT_APDU_COLLECT)
+				{
+					if (out_used + resp_length > out_size)
+					{
+						result = SCRIPT_RESULT_OVERFLOW;
+						goto end;
+					}
+					memcpy(out + out_used, resp, resp_length);
+					out_used += resp_length;
+				}
+
+				if ((flags & SCRIPT_APDU_STOP_ON_ERROR)
+					&& (sw[0] != 0x90 || sw[1] != 0x00))
+				{
+					result = SCRIPT_RESULT_SW_ERROR;
+					goto end;
+				}
+
+				pc += 4 + len + n * 3;
+				break;
+			}
+
+			case SCRIPT_OP_LOAD:
+				if (!ScriptFetch(script_length, pc, 4)
+					|| p[1] >= SCRIPT_REGISTERS || p[3] < 1 || p[3] > 2)
+					goto malformed;
+				/* the field must have been returned by the last APDU */
+				if ((unsigned int)p[2] + p[3] > resp_length)
+				{
+					DEBUG_INFO3("LOAD out of response: %u > %u",
+						p[2] + p[3], resp_length);
+					result = SCRIPT_RESULT_FAIL;
+					goto end;
+				}
+				reg[p[1]] = resp[p[2]];
+				if (2 == p[3])
+					reg[p[1]] = (reg[p[1]] << 8) | resp[p[2] + 1];
+				pc += 4;
+				break;
+
+			case SCRIPT_OP_SET:
+				if (!ScriptFetch(script_length, pc, 4)
+					|| p[1] >= SCRIPT_REGISTERS)
+					goto malformed;
+				reg[p[1]] = (p[2] << 8) | p[3];
+				pc += 4;
+				break;
+
+			case SCRIPT_OP_MOV:
+			case SCRIPT_OP_ADD:
+			case SCRIPT_OP_SUB:
+			case SCRIPT_OP_MIN:
+				if (!ScriptFetch(script_length, pc, 3)
+					|| p[1] >= SCRIPT_REGISTERS || p[2] >= SCRIPT_REGISTERS)
+					goto malformed;
+				if (SCRIPT_OP_MOV == p[0])
+					reg[p[1]] = reg[p[2]];
+				else if (SCRIPT_OP_ADD == p[0])
+					reg[p[1]] += reg[p[2]];
+				else if (SCRIPT_OP_SUB == p[0])
+					reg[p[1]] = (reg[p[2]] > reg[p[1]]) ?
+						0 : reg[p[1]] - reg[p[2]];
+				else
+					reg[p[1]] = min(reg[p[1]], reg[p[2]]);
+				pc += 3;
+				break;
+
+			case SCRIPT_OP_JSW:
+			case SCRIPT_OP_JNSW:
+			{
+				int match;
+
+				if (!ScriptFetch(script_length, pc, 7))
+					goto malformed;
+				match = ((sw[0] & p[3]) == p[1]) && ((sw[1] & p[4]) == p[2]);
+				if (match == (SCRIPT_OP_JSW == p[0]))
+					pc = ScriptTarget(p + 5);
+				else
+					pc += 7;
+				break;
+			}
+
+			case SCRIPT_OP_JNZ:
+				if (!ScriptFetch(script_length, pc, 4)
+					|| p[1] >= SCRIPT_REGISTERS)
+					goto malformed;
+				if (reg[p[1]])
+					pc = ScriptTarget(p + 2);
+				else
+					pc += 4;
+				break;
+
+			case SCRIPT_OP_JMP:
+				if (!ScriptFetch(script_length, pc, 3))
+					goto malformed;
+				pc = ScriptTarget(p + 1);
+				break;
+
+			default:
+				goto malformed;
+		}
+	}
+
+	DEBUG_INFO("step budget exhausted");
+
+end:
+	out[0] = result;
+	out[1] = sw[0];
+	out[2] = sw[1];
+	*out_length = out_used;
+
+	DEBUG_COMM3("script result: %d, SW: %s", result,
+		array_hexdump(sw, sizeof(sw)));
+
+	return IFD_SUCCESS;
+
+malformed:
+	DEBUG_INFO2("malformed script at step %u", pc);
+	return IFD_COMMUNICATION_ERROR;
+} /* ScriptRun */
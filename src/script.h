@@ -0,0 +1,33 @@
+/*
+    script.h: APDU scripts run inside the driver
+    Copyright (C) 2012 Aktiv Co
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public License
+	along with this library; if not, write to the Free Software Foundation,
+	Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#ifndef SCRIPT_H
+#define SCRIPT_H
+
+/* Step budget used when the script does not give one */
+#define SCRIPT_DEFAULT_BUDGET	256
+/* Hard limit of the step budget */
+#define SCRIPT_MAX_BUDGET	4096
+
+RESPONSECODE ScriptRun(unsigned int reader_index,
+	const unsigned char script[], unsigned int script_length,
+	unsigned char out[], unsigned int *out_length);
+
+#endif
@@ -0,0 +1,170 @@
+/*
+    stats.c: counters of each reader
+    Copyright (C) 2012 Aktiv Co
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public License
+	along with this library; if not, write to the Free Software Foundation,
+	Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+
+#include <pcsclite.h>
+#include <ifdhandler.h>
+
+#include "misc.h"
+#include "config.h"
+#include "rutokens.h"
+#include "defs.h"
+#include "readers.h"
+#include "debug.h"
+#include "utils.h"
+#include "stats.h"
+#include "rutokens_ctl.h"
+
+#if RUTOKENS_STATS_SIZE != 4 * (12 + STATS_LATENCY_BUCKETS)
+#error "RUTOKENS_STATS_SIZE does not match the latency buckets"
+#endif
+
+/* internal functions */
+
+static unsigned int StatsPercentile(const _reader_stats *stats,
+	unsigned int total, unsigned int percent);
+
+static unsigned char *StatsPut(unsigned char *p, unsigned int value);
+
+
+/*****************************************************************************
+ *
+ *					StatsCommand
+ *
+ *  count a command sent to the token, latency in ms
+ ****************************************************************************/
+void StatsCommand(unsigned int reader_index, unsigned int latency,
+	RESPONSECODE r, int cancelled)
+{
+	_reader_stats *stats = &Readers[reader_index].stats;
+	unsigned int i;
+
+	if (r != IFD_SUCCESS)
+		stats->errors++;
+	if (cancelled)
+		stats->cancels++;
+
+	/* bucket i counts the latencies from 2^(i-1) to 2^i - 1 ms */
+	for (i = 0; i < STATS_LATENCY_BUCKETS - 1 && latency >= (1U << i); i++)
+		;
+	stats->latency[i]++;
+
+	if (latency > stats->latencyMax)
+		stats->latencyMax = latency;
+} /* StatsCommand */
+
+
+/*****************************************************************************
+ *
+ *					StatsGet
+ *
+ *  write the RUTOKENS_STATS_SIZE bytes of the counters of a reader
+ ****************************************************************************/
+void StatsGet(unsigned int reader_index, unsigned char out[])
+{
+	const _reader_stats *stats = &Readers[reader_index].stats;
+	unsigned int i, total = 0;
+	unsigned char *p = out;
+
+	for (i = 0; i < STATS_LATENCY_BUCKETS; i++)
+		total += stats->latency[i];
+
+	p = StatsPut(p, stats->apdus);
+	p = StatsPut(p, stats->cacheHits);
+	p = StatsPut(p, stats->transfers);
+	p = StatsPut(p, stats->apduTransfers);
+	p = StatsPut(p, stats->busyPolls);
+	p = StatsPut(p, stats->busyTime);
+	p = StatsPut(p, stats->errors);
+	p = StatsPut(p, stats->cancels);
+	p = StatsPut(p, StatsPercentile(stats, total, 50));
+	p = StatsPut(p, StatsPercentile(stats, total, 90));
+	p = StatsPut(p, StatsPercentile(stats, total, 99));
+	p = StatsPut(p, stats->latencyMax);
+	for (i = 0; i < STATS_LATENCY_BUCKETS; i++)
+		p = StatsPut(p, stats->latency[i]);
+} /* StatsGet */
+
+
+/*****************************************************************************
+ *
+ *					StatsRun
+ *
+ ****************************************************************************/
+RESPONSECODE StatsRun(unsigned int reader_index,
+	const unsigned char in[], unsigned int in_length,
+	unsigned char out[], unsigned int *out_length)
+{
+	(void)in;
+
+	if (in_length != 0 || *out_length < RUTOKENS_STATS_SIZE)
+	{
+		*out_length = 0;
+		return IFD_COMMUNICATION_ERROR;
+	}
+
+	StatsGet(reader_index, out);
+	*out_length = RUTOKENS_STATS_SIZE;
+
+	return IFD_SUCCESS;
+} /* StatsRun */
+
+
+/*****************************************************************************
+ *
+ *					StatsPercentile
+ *
+ *  return the highest latency of the bucket holding the percentile
+ ****************************************************************************/
+static unsigned int StatsPercentile(const _reader_stats *stats,
+	unsigned int total, unsigned int percent)
+{
+	unsigned long long rank;
+	unsigned int i, seen = 0;
+
+	if (0 == total)
+		return 0;
+
+	rank = ((unsigned long long)total * percent + 99) / 100;
+	for (i = 0; i < STATS_LATENCY_BUCKETS - 1; i++)
+	{
+		seen += stats->latency[i];
+		if (seen >= rank)
+			return min((1U << i) - 1, stats->latencyMax);
+	}
+
+	return stats->latencyMax;
+} /* StatsPercentile */
+
+
+/*****************************************************************************
+ *
+ *					StatsPut
+ *
+ ****************************************************************************/
+static unsigned char *StatsPut(unsigned char *p, unsigned int value)
+{
+	p[0] = value >> 24;
+	p[1] = value >> 16;
+	p[2] = value >> 8;
+	p[3] = value;
+
+	return p + 4;
+} /* StatsPut */
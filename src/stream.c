@@ -0,0 +1,134 @@
+/*
+    stream.c: long data streamed through the token inside the driver
+    Copyright (C) 2012 Aktiv Co
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public License
+	along with this library; if not, write to the Free Software Foundation,
+	Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include <string.h>
+#include <pcsclite.h>
+#include <ifdhandler.h>
+
+#include "misc.h"
+#include "config.h"
+#include "defs.h"
+#include "debug.h"
+#include "commands.h"
+#include "stream.h"
+#include "rutokens_ctl.h"
+
+/* flags + command header + chunk size */
+#define STREAM_IN_HDR_LEN	6
+/* SW */
+#define STREAM_OUT_HDR_LEN	2
+
+/* chaining bit of the class byte */
+#define STREAM_CLA_CHAINING	0x10
+
+
+/*****************************************************************************
+ *
+ *					StreamRun
+ *
+ ****************************************************************************/
+RESPONSECODE StreamRun(unsigned int reader_index,
+	const unsigned char in[], unsigned int in_length,
+	unsigned char out[], unsigned int *out_length)
+{
+	unsigned char apdu[CMD_BUF_SIZE];
+	unsigned char resp[RESP_BUF_SIZE];
+	unsigned int resp_length;
+	unsigned int out_size = *out_length;
+	unsigned int out_used = STREAM_OUT_HDR_LEN;
+	unsigned int flags, chunk, left, n, len;
+	unsigned char sw[2];
+	const unsigned char *data;
+	int last;
+	RESPONSECODE r;
+
+	*out_length = 0;
+
+	if (in_length < STREAM_IN_HDR_LEN || out_size < STREAM_OUT_HDR_LEN)
+		return IFD_COMMUNICATION_ERROR;
+
+	flags = in[0];
+	chunk = in[5];
+	if (0 == chunk)
+		chunk = STREAM_DEFAULT_CHUNK;
+	data = in + STREAM_IN_HDR_LEN;
+	left = in_length - STREAM_IN_HDR_LEN;
+
+	DEBUG_COMM3("stream %u bytes, chunks of %u", left, chunk);
+
+	/* the header is the same for every chunk but the class byte */
+	memcpy(apdu, in + 1, 4);
+
+	do
+	{
+		n = (left < chunk) ? left : chunk;
+		last = (n == left);
+
+		/* every chunk but the last one of the stream is chained */
+		apdu[0] = in[1];
+		if (!last || (flags & STREAM_MORE))
+			apdu[0] |= STREAM_CLA_CHAINING;
+
+		len = 4;
+		if (n)
+		{
+			apdu[len++] = n;
+			memcpy(apdu + len, data, n);
+			len += n;
+		}
+		if (last && (flags & STREAM_LE))
+			apdu[len++] = 0;
+
+		resp_length = sizeof(resp);
+		r = CmdXfrBlock(reader_index, len, apdu, &resp_length, resp, T_0);
+		if (r != IFD_SUCCESS)
+			return r;
+		if (resp_length < sizeof(sw))
+			return IFD_COMMUNICATION_ERROR;
+
+		/* keep the data only, the SW is stored apart */
+		resp_length -= sizeof(sw);
+		memcpy(sw, resp + resp_length, sizeof(sw));
+
+		if ((flags & STREAM_COLLECT) || (last && (flags & STREAM_LE)))
+		{
+			if (resp_length > out_size - out_used)
+			{
+				DEBUG_INFO("RxBuffer too short for the stream output");
+				return IFD_COMMUNICATION_ERROR;
+			}
+			memcpy(out + out_used, resp, resp_length);
+			out_used += resp_length;
+		}
+
+		data += n;
+		left -= n;
+	} while (left > 0 && 0x90 == sw[0] && 0x00 == sw[1]);
+
+	if (left > 0)
+		DEBUG_INFO3("stream stopped by SW %02X%02X", sw[0], sw[1]);
+
+	out[0] = sw[0];
+	out[1] = sw[1];
+	*out_length = out_used;
+
+	return IFD_SUCCESS;
+} /* StreamRun */
+
@@ -0,0 +1,297 @@
+/*
+    template.c: file system templates applied inside the driver
+    Copyright (C) 2012 Aktiv Co
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public License
+	along with this library; if not, write to the Free Software Foundation,
+	Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include <string.h>
+#include <pcsclite.h>
+#include <ifdhandler.h>
+
+#include "misc.h"
+#include "config.h"
+#include "defs.h"
+#include "debug.h"
+#include "utils.h"
+#include "apdu.h"
+#include "commands.h"
+#include "instructions.h"
+#include "template.h"
+#include "rutokens_ctl.h"
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+/* flags + length */
+#define TEMPLATE_STEP_HDR_LEN	3
+/* result + SW + step */
+#define TEMPLATE_OUT_HDR_LEN	5
+/* generation of a loaded template */
+#define TEMPLATE_GENERATION_LEN	4
+
+/* the step data is already translated for the token */
+#define TEMPLATE_STEP_TRANSLATED	0x80
+
+/*
+ * A compiled template is a list of steps:
+ *   flags len[2] apdu[len] [lc data[lc]]
+ * lc and data, the command data translated for the token, are only
+ * present if TEMPLATE_STEP_TRANSLATED is set.
+ */
+typedef struct
+{
+	/* TemplateGeneration when the template was loaded */
+	unsigned int generation;
+	unsigned int length;
+	unsigned int steps;
+	unsigned char code[TEMPLATE_MAX_SIZE];
+} _template;
+
+/* ne need to initialize to 0 since it is static */
+static _template Templates[TEMPLATE_SLOTS];
+
+/* generation of the last template loaded, in any slot */
+static unsigned int TemplateGeneration = 0;
+
+#ifdef HAVE_PTHREAD
+/* loading a template must not disturb the readers applying it */
+static pthread_rwlock_t TemplateLock = PTHREAD_RWLOCK_INITIALIZER;
+#endif
+
+
+/*****************************************************************************
+ *
+ *					TemplateCompile
+ *
+ *  return FALSE if the template is malformed or too big
+ ****************************************************************************/
+static int TemplateCompile(_template *tpl, const unsigned char in[],
+	unsigned int in_length)
+{
+	unsigned char data[CMD_BUF_SIZE];
+	unsigned int pc = 0, flags, len;
+	const _instruction *ins;
+	ifd_iso_apdu_t iso;
+	int lc;
+
+	tpl->length = 0;
+	tpl->steps = 0;
+
+	while (pc < in_length)
+	{
+		if (in_length - pc < TEMPLATE_STEP_HDR_LEN)
+			return FALSE;
+		flags = in[pc] & ~TEMPLATE_STEP_TRANSLATED;
+		len = (in[pc + 1] << 8) | in[pc + 2];
+		pc += TEMPLATE_STEP_HDR_LEN;
+		if (len > in_length - pc || len > CMD_BUF_SIZE
+			|| ifd_iso_apdu_parse(in + pc, len, &iso) < 0)
+			return FALSE;
+
+		/* translate the command data once for all the tokens */
+		lc = -1;
+		ins = InstructionFind(&iso);
+		if (ins->tx && iso.lc)
+		{
+			memcpy(data, iso.data, iso.lc);
+			lc = ins->tx(data, iso.lc);
+			if (lc < 0)
+				lc = iso.lc;
+			if (lc > 0xFF)
+				return FALSE;
+			flags |= TEMPLATE_STEP_TRANSLATED;
+		}
+
+		if (TEMPLATE_STEP_HDR_LEN + len + ((lc >= 0) ? 1 + lc : 0)
+			> sizeof(tpl->code) - tpl->length)
+			return FALSE;
+
+		tpl->code[tpl->length++] = flags;
+		tpl->code[tpl->length++] = len >> 8;
+		tpl->code[tpl->length++] = len;
+		memcpy(tpl->code + tpl->length, in + pc, len);
+		tpl->length += len;
+		if (lc >= 0)
+		{
+			tpl->code[tpl->length++] = lc;
+			memcpy(tpl->code + tpl->length, data, lc);
+			tpl->length += lc;
+		}
+
+		pc += len;
+		tpl->steps++;
+	}
+
+	return TRUE;
+} /* TemplateCompile */
+
+
+/*****************************************************************************
+ *
+ *					TemplateLoad
+ *
+ ****************************************************************************/
+RESPONSECODE TemplateLoad(const unsigned char in[], unsigned int in_length,
+	unsigned char out[], unsigned int *out_length)
+{
+	unsigned int out_size = *out_length;
+	unsigned int generation;
+	_template *tpl;
+	int ok;
+
+	*out_length = 0;
+
+	if (in_length < 1 || in[0] >= TEMPLATE_SLOTS
+		|| out_size < TEMPLATE_GENERATION_LEN)
+		return IFD_COMMUNICATION_ERROR;
+	tpl = &Templates[in[0]];
+
+#ifdef HAVE_PTHREAD
+	pthread_rwlock_wrlock(&TemplateLock);
+#endif
+
+	/* an application still holding the previous generation of the slot
+	 * can't apply this template by mistake */
+	generation = tpl->generation = ++TemplateGeneration;
+	ok = TemplateCompile(tpl, in + 1, in_length - 1);
+	if (!ok)
+	{
+		tpl->length = 0;
+		tpl->steps = 0;
+	}
+
+#ifdef HAVE_PTHREAD
+	pthread_rwlock_unlock(&TemplateLock);
+#endif
+
+	if (!ok)
+	{
+		DEBUG_INFO2("Invalid template for slot %d", in[0]);
+		return IFD_COMMUNICATION_ERROR;
+	}
+
+	DEBUG_INFO4("Template %u of %u steps loaded in slot %d", generation,
+		tpl->steps, in[0]);
+
+	out[0] = generation >> 24;
+	out[1] = generation >> 16;
+	out[2] = generation >> 8;
+	out[3] = generation;
+	*out_length = TEMPLATE_GENERATION_LEN;
+
+	return IFD_SUCCESS;
+} /* TemplateLoad */
+
+
+/*****************************************************************************
+ *
+ *					TemplateApply
+ *
+ ****************************************************************************/
+RESPONSECODE TemplateApply(unsigned int reader_index,
+	const unsigned char in[], unsigned int in_length,
+	unsigned char out[], unsigned int *out_length)
+{
+	unsigned char resp[RESP_BUF_SIZE];
+	unsigned int resp_length;
+	unsigned int out_size = *out_length;
+	unsigned int pc = 0, step = 0, flags, len, lc;
+	unsigned char sw[2] = { 0, 0 };
+	unsigned char result = TEMPLATE_RESULT_END;
+	unsigned char *apdu, *data;
+	const _template *tpl;
+	unsigned int generation;
+	RESPONSECODE r = IFD_SUCCESS;
+
+	*out_length = 0;
+
+	if (in_length != 1 + TEMPLATE_GENERATION_LEN || in[0] >= TEMPLATE_SLOTS
+		|| out_size < TEMPLATE_OUT_HDR_LEN)
+		return IFD_COMMUNICATION_ERROR;
+	tpl = &Templates[in[0]];
+	generation = (in[1] << 24) | (in[2] << 16) | (in[3] << 8) | in[4];
+
+#ifdef HAVE_PTHREAD
+	pthread_rwlock_rdlock(&TemplateLock);
+#endif
+
+	/* the slot was loaded again since, maybe through another reader */
+	if (generation != tpl->generation)
+	{
+		DEBUG_INFO3("Template %u replaced by %u", generation, tpl->generation);
+		result = TEMPLATE_RESULT_REPLACED;
+		pc = tpl->length;
+	}
+	else if (0 == tpl->steps)
+		result = TEMPLATE_RESULT_EMPTY;
+
+	for (; pc < tpl->length; step++)
+	{
+		flags = tpl->code[pc];
+		len = (tpl->code[pc + 1] << 8) | tpl->code[pc + 2];
+		apdu = (unsigned char *)tpl->code + pc + TEMPLATE_STEP_HDR_LEN;
+		pc += TEMPLATE_STEP_HDR_LEN + len;
+
+		data = NULL;
+		lc = 0;
+		if (flags & TEMPLATE_STEP_TRANSLATED)
+		{
+			lc = tpl->code[pc];
+			data = (unsigned char *)tpl->code + pc + 1;
+			pc += 1 + lc;
+		}
+
+		resp_length = sizeof(resp);
+		r = CmdXfrBlockTranslated(reader_index, len, apdu, data, lc,
+			&resp_length, resp, T_0);
+		if (r != IFD_SUCCESS)
+			break;
+		if (resp_length < sizeof(sw))
+		{
+			r = IFD_COMMUNICATION_ERROR;
+			break;
+		}
+		memcpy(sw, resp + resp_length - sizeof(sw), sizeof(sw));
+
+		if ((sw[0] != 0x90 || sw[1] != 0x00)
+			&& !(flags & TEMPLATE_STEP_IGNORE_SW))
+		{
+			result = TEMPLATE_RESULT_SW_ERROR;
+			break;
+		}
+	}
+
+#ifdef HAVE_PTHREAD
+	pthread_rwlock_unlock(&TemplateLock);
+#endif
+
+	if (r != IFD_SUCCESS)
+		return r;
+
+	DEBUG_COMM3("template applied up to step %u, result %u", step, result);
+
+	out[0] = result;
+	out[1] = sw[0];
+	out[2] = sw[1];
+	out[3] = step >> 8;
+	out[4] = step;
+	*out_length = TEMPLATE_OUT_HDR_LEN;
+
+	return IFD_SUCCESS;
+} /* TemplateApply */
+
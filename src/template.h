@@ -0,0 +1,36 @@
+/*
+    template.h: file system templates applied inside the driver
+    Copyright (C) 2012 Aktiv Co
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public License
+	along with this library; if not, write to the Free Software Foundation,
+	Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#ifndef TEMPLATE_H
+#define TEMPLATE_H
+
+/* Number of templates kept by the driver */
+#define TEMPLATE_SLOTS	4
+/* Size of a compiled template */
+#define TEMPLATE_MAX_SIZE	16384
+
+RESPONSECODE TemplateLoad(const unsigned char in[], unsigned int in_length,
+	unsigned char out[], unsigned int *out_length);
+
+RESPONSECODE TemplateApply(unsigned int reader_index,
+	const unsigned char in[], unsigned int in_length,
+	unsigned char out[], unsigned int *out_length);
+
+#endif
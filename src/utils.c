@@ -19,21 +19,41 @@
 */
 
 
+#include <time.h>
+#include <string.h>
 #include <pcsclite.h>
 
+#include "misc.h"
+#include "config.h"
 #include "rutokens.h"
 #include "defs.h"
+#include "readers.h"
 #include "utils.h"
 #include "debug.h"
 
-int ReaderIndex[DRIVER_MAX_READERS];
+_reader Readers[DRIVER_MAX_READERS];
+
+_reader_tuning DriverTuning = {
+	0,							/* powerDownDelay */
+	0,							/* presenceTTL */
+	DEFAULT_COM_READ_TIMEOUT,	/* readTimeout */
+	DEFAULT_BUSY_BUDGET,		/* busyBudget */
+	DEFAULT_BUSY_INTERVAL,		/* busyInterval */
+	TRUE						/* cache */
+};
 
 void InitReaderIndex(void)
 {
 	int i;
 
 	for (i=0; i<DRIVER_MAX_READERS; i++)
-		ReaderIndex[i] = -1;
+	{
+		Readers[i].lun = -1;
+		Readers[i].logLevel = -1;
+#ifdef HAVE_PTHREAD
+		pthread_mutex_init(&Readers[i].lock, NULL);
+#endif
+	}
 } /* InitReaderIndex */
 
 int GetNewReaderIndex(const int Lun)
@@ -42,7 +62,7 @@ int GetNewReaderIndex(const int Lun)
 
 	/* check that Lun is NOT already used */
 	for (i=0; i<DRIVER_MAX_READERS; i++)
-		if (Lun == ReaderIndex[i])
+		if (Lun == Readers[i].lun)
 			break;
 
 	if (i < DRIVER_MAX_READERS)
@@ -52,13 +72,16 @@ int GetNewReaderIndex(const int Lun)
 	}
 
 	for (i=0; i<DRIVER_MAX_READERS; i++)
-		if (-1 == ReaderIndex[i])
+		if (-1 == Readers[i].lun)
 		{
-			ReaderIndex[i] = Lun;
+			Readers[i].lun = Lun;
+			Readers[i].logLevel = -1;
+			Readers[i].tuning = DriverTuning;
+			memset(&Readers[i].stats, 0, sizeof(Readers[i].stats));
 			return i;
 		}
 
-	DEBUG_CRITICAL("ReaderIndex[] is full");
+	DEBUG_CRITICAL("Readers[] is full");
 	return -1;
 } /* GetReaderIndex */
 
@@ -67,7 +90,7 @@ int LunToReaderIndex(const int Lun)
 	int i;
 
 	for (i=0; i<DRIVER_MAX_READERS; i++)
-		if (Lun == ReaderIndex[i])
+		if (Lun == Readers[i].lun)
 			return i;
 
 	DEBUG_CRITICAL2("Lun: %X not found", Lun);
@@ -76,6 +99,65 @@ int LunToReaderIndex(const int Lun)
 
 void ReleaseReaderIndex(const int index)
 {
-	ReaderIndex[index] = -1;
+	Readers[index].lun = -1;
 } /* ReleaseReaderIndex */
 
+void SetReaderLogLevel(const int index, int level)
+{
+	Readers[index].logLevel = level;
+} /* SetReaderLogLevel */
+
+int GetReaderLogLevel(const int index)
+{
+	return (Readers[index].logLevel >= 0) ? Readers[index].logLevel : LogLevel;
+} /* GetReaderLogLevel */
+
+/* the next logs of the thread use the LogLevel of the reader (-1: none) */
+void LogReader(const int index)
+{
+	LogThreadLevel = (index >= 0) ? Readers[index].logLevel : -1;
+} /* LogReader */
+
+/* same for the reader of Lun, if any */
+void LogLun(int Lun)
+{
+	int i;
+
+	LogThreadLevel = -1;
+	for (i=0; i<DRIVER_MAX_READERS; i++)
+		if (Lun == Readers[i].lun)
+			LogThreadLevel = Readers[i].logLevel;
+} /* LogLun */
+
+void ReaderLock(const int index)
+{
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&Readers[index].lock);
+#endif
+} /* ReaderLock */
+
+int ReaderTryLock(const int index)
+{
+#ifdef HAVE_PTHREAD
+	return 0 == pthread_mutex_trylock(&Readers[index].lock);
+#else
+	return TRUE;
+#endif
+} /* ReaderTryLock */
+
+void ReaderUnlock(const int index)
+{
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&Readers[index].lock);
+#endif
+} /* ReaderUnlock */
+
+unsigned long long GetTimeMs(void)
+{
+	struct timespec ts;
+
+	/* not affected by changes of the system date */
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+} /* GetTimeMs */
@@ -27,4 +27,12 @@ void InitReaderIndex(void);
 int GetNewReaderIndex(const int Lun);
 int LunToReaderIndex(int Lun);
 void ReleaseReaderIndex(const int index);
+void SetReaderLogLevel(const int index, int level);
+int GetReaderLogLevel(const int index);
+void LogReader(const int index);
+void LogLun(int Lun);
+void ReaderLock(const int index);
+int ReaderTryLock(const int index);
+void ReaderUnlock(const int index);
+unsigned long long GetTimeMs(void);
 
@@ -0,0 +1,173 @@
+/*
+    test_alloc.c: APDUs are sent without allocating memory
+    Copyright (C) 2012 Aktiv Co
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public License
+	along with this library; if not, write to the Free Software Foundation,
+	Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+
+#include <stdio.h>
+#include <string.h>
+#include <pcsclite.h>
+#include <ifdhandler.h>
+
+#include "misc.h"
+#include "config.h"
+#include "rutokens.h"
+#include "defs.h"
+#include "readers.h"
+#include "utils.h"
+#include "commands.h"
+#include "apdu.h"
+#include "instructions.h"
+#include "tokensim.h"
+
+/* exit code of an automake test which can't run here */
+#define TEST_SKIPPED	77
+
+#define ARRAY_SIZE(a)	(sizeof(a) / sizeof((a)[0]))
+
+/* rounds of APDUs counted after the warm up round */
+#define ROUNDS	100
+
+#ifdef __GLIBC__
+#include <stddef.h>
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static int Counting = FALSE;
+static long Allocations = 0;
+
+void *malloc(size_t size)
+{
+	if (Counting)
+		Allocations++;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	if (Counting)
+		Allocations++;
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	if (Counting)
+		Allocations++;
+	return __libc_realloc(ptr, size);
+}
+#endif
+
+typedef struct
+{
+	const char *name;
+	unsigned char command[16];
+	unsigned int length;
+	/* expected answer length, SW included */
+	unsigned int answer;
+} _apdu;
+
+static const _apdu Apdus[] =
+{
+	{ "select MF", { 0x00, 0xa4, 0x00, 0x00, 0x02, 0x3f, 0x00, 0x00 }, 8, 0 },
+	{ "select EF", { 0x00, 0xa4, 0x00, 0x00, 0x02, 0x00, 0x01, 0x00 }, 8, 0 },
+	{ "read binary", { 0x00, 0xb0, 0x00, 0x00, SIM_EF_SIZE }, 5,
+		SIM_EF_SIZE + 2 },
+	{ "get challenge", { 0x00, 0x84, 0x00, 0x00, 0x08 }, 5, 8 + 2 },
+	{ "verify", { 0x00, 0x20, 0x00, 0x02, 0x04, '1', '2', '3', '4' }, 9, 2 },
+};
+
+static int Failures = 0;
+
+
+/*****************************************************************************
+ *
+ *					SendApdus
+ *
+ *  send each APDU once and check its answer
+ ****************************************************************************/
+static void SendApdus(unsigned int reader_index)
+{
+	unsigned char rx[RESP_BUF_SIZE];
+	unsigned int i, j, rx_length;
+	RESPONSECODE r;
+
+	for (i = 0; i < ARRAY_SIZE(Apdus); i++)
+	{
+		rx_length = sizeof(rx);
+		r = CmdXfrBlock(reader_index, Apdus[i].length,
+			(unsigned char *)Apdus[i].command, &rx_length, rx, T_0);
+		if (r != IFD_SUCCESS || rx_length < 2
+			|| rx[rx_length - 2] != 0x90 || rx[rx_length - 1] != 0x00
+			|| (Apdus[i].answer && rx_length != Apdus[i].answer))
+		{
+			printf("%s failed: %ld, %u bytes\n", Apdus[i].name, r, rx_length);
+			Failures++;
+			continue;
+		}
+
+		if (0xb0 == Apdus[i].command[1])
+			for (j = 0; j < SIM_EF_SIZE; j++)
+				if (rx[j] != SimEfByte(j))
+				{
+					printf("%s: byte %u is 0x%02X\n", Apdus[i].name, j, rx[j]);
+					Failures++;
+					break;
+				}
+	}
+} /* SendApdus */
+
+
+int main(void)
+{
+	unsigned char atr[MAX_ATR_SIZE];
+	unsigned int atr_length = sizeof(atr);
+	int reader_index, i;
+
+#ifndef __GLIBC__
+	printf("malloc can't be counted here\n");
+	return TEST_SKIPPED;
+#else
+	/* no Info.plist: no instruction profile */
+	InstructionInit("/dev/null");
+	InitReaderIndex();
+	reader_index = GetNewReaderIndex(0);
+	SimPlug(reader_index);
+
+	if (CmdPowerOn(reader_index, &atr_length, atr) != IFD_SUCCESS)
+	{
+		printf("power on failed\n");
+		return 1;
+	}
+
+	/* the first commands may set things up */
+	SendApdus(reader_index);
+
+	Counting = TRUE;
+	for (i = 0; i < ROUNDS; i++)
+		SendApdus(reader_index);
+	Counting = FALSE;
+
+	printf("%d rounds, %ld transfers, %ld allocations, %d failures\n",
+		ROUNDS, SimTransfers, Allocations, Failures);
+
+	return (Failures || Allocations) ? 1 : 0;
+#endif
+} /* main */
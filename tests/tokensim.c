@@ -0,0 +1,360 @@
+/*
+    tokensim.c: simulated Rutoken S behind ControlUSB()
+    Copyright (C) 2012 Aktiv Co
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public License
+	along with this library; if not, write to the Free Software Foundation,
+	Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <pcsclite.h>
+#include <ifdhandler.h>
+
+#include "misc.h"
+#include "config.h"
+#include "rutokens.h"
+#include "defs.h"
+#include "readers.h"
+#include "utils.h"
+#include "rutokens_usb.h"
+#include "commands.h"
+#include "tokensim.h"
+
+/* the driver keeps its log level in ifdhandler.c, not linked here */
+int LogLevel = 0;
+#ifdef HAVE___THREAD
+__thread int LogThreadLevel = -1;
+#else
+int LogThreadLevel = -1;
+#endif
+
+long SimTransfers = 0;
+
+/* T=0 state of the token, the one read by USB_ICC_GET_STATUS */
+#define SIM_IDLE		0x00
+#define SIM_READY_DATA	0x10
+#define SIM_READY_SW	0x20
+
+static unsigned char State;
+static unsigned char Header[5];
+static unsigned char Data[CMD_BUF_SIZE];
+static unsigned int DataLength;
+static int ExpectData;
+static unsigned char Answer[RESP_BUF_SIZE];
+static unsigned int AnswerLength;
+static unsigned short Sw;
+
+/* the current file is the MF (0) or the EF (1) */
+static int CurrentEf;
+
+
+/*****************************************************************************
+ *
+ *					log_msg
+ *
+ *  pcscd gives its log functions to the driver, the tests log on stderr
+ ****************************************************************************/
+void log_msg(const int priority, const char *fmt, ...)
+{
+	va_list argptr;
+
+	(void)priority;
+
+	va_start(argptr, fmt);
+	vfprintf(stderr, fmt, argptr);
+	va_end(argptr);
+	fputc('\n', stderr);
+} /* log_msg */
+
+
+/*****************************************************************************
+ *
+ *					log_xxd
+ *
+ ****************************************************************************/
+void log_xxd(const int priority, const char *msg, const unsigned char *buffer,
+	const int size)
+{
+	int i;
+
+	(void)priority;
+
+	fputs(msg, stderr);
+	for (i = 0; i < size; i++)
+		fprintf(stderr, "%02X ", buffer[i]);
+	fputc('\n', stderr);
+} /* log_xxd */
+
+
+/*****************************************************************************
+ *
+ *					SimEfByte
+ *
+ ****************************************************************************/
+unsigned char SimEfByte(unsigned int offset)
+{
+	return offset * 7 + 1;
+} /* SimEfByte */
+
+
+/*****************************************************************************
+ *
+ *					SimRtprot
+ *
+ *  rtprot header of the current file as answered to SELECT FILE
+ ****************************************************************************/
+static void SimRtprot(unsigned char rtprot[])
+{
+	unsigned int fid = CurrentEf ? SIM_EF_FID : 0x3F00;
+	unsigned int size = CurrentEf ? SIM_EF_SIZE : 0;
+
+	memset(rtprot, 0, 32);
+	rtprot[0] = rtprot[2] = size;
+	rtprot[1] = rtprot[3] = size >> 8;
+	rtprot[4] = CurrentEf ? 0x01 : 0x38;
+	rtprot[6] = fid;
+	rtprot[7] = fid >> 8;
+	rtprot[8] = 5;
+} /* SimRtprot */
+
+
+/*****************************************************************************
+ *
+ *					SimProcess
+ *
+ *  run the command of Header and Data
+ ****************************************************************************/
+static void SimProcess(void)
+{
+	/* P3 is the Le of a case 2 command */
+	unsigned int i, fid, offset, le = Header[4] ? Header[4] : 256;
+
+	AnswerLength = 0;
+	Sw = 0x9000;
+
+	switch (Header[1])
+	{
+		case 0xa4:
+			/* the driver sends the file identifier little endian */
+			fid = Data[0] | (Data[1] << 8);
+			if (DataLength != 2 || (fid != 0x3F00 && fid != SIM_EF_FID))
+			{
+				Sw = 0x6a82;
+				break;
+			}
+			CurrentEf = (SIM_EF_FID == fid);
+			SimRtprot(Answer);
+			AnswerLength = 32;
+			break;
+
+		case 0xb0:
+			offset = (Header[2] << 8) | Header[3];
+			if (!CurrentEf || offset >= SIM_EF_SIZE)
+			{
+				Sw = 0x6b00;
+				break;
+			}
+			for (i = 0; i < le && offset + i < SIM_EF_SIZE; i++)
+				Answer[i] = SimEfByte(offset + i);
+			AnswerLength = i;
+			break;
+
+		case 0x84:
+			for (i = 0; i < le; i++)
+				Answer[i] = i;
+			AnswerLength = le;
+			break;
+
+		case 0x20:
+			break;
+
+		default:
+			Sw = 0x6d00;
+			break;
+	}
+} /* SimProcess */
+
+
+/*****************************************************************************
+ *
+ *					SimCase3
+ *
+ *  the command header is followed by data
+ ****************************************************************************/
+static int SimCase3(void)
+{
+	switch (Header[1])
+	{
+		case 0xb0:
+		case 0xc0:
+		case 0x84:
+			return FALSE;
+
+		case 0xa4:
+			return Header[4] != 0x20;
+
+		default:
+			return TRUE;
+	}
+} /* SimCase3 */
+
+
+/*****************************************************************************
+ *
+ *					ControlUSB
+ *
+ ****************************************************************************/
+int ControlUSB(int reader_index, int requesttype, int request, int value,
+	unsigned char *bytes, unsigned int size)
+{
+	unsigned int n;
+
+	(void)reader_index;
+	(void)requesttype;
+	(void)value;
+
+	SimTransfers++;
+
+	switch (request)
+	{
+		case 0x62:
+			/* power on: the ATR of a Rutoken S */
+			State = SIM_IDLE;
+			CurrentEf = 0;
+			n = min(size, RUTOKEN_ATR_LEN);
+			memset(bytes, 0, n);
+			bytes[0] = 0x3B;
+			return n;
+
+		case 0x63:
+			State = SIM_IDLE;
+			return 0;
+
+		case 0xA0:
+			bytes[0] = State;
+			return 1;
+
+		case 0x65:
+			if (SIM_IDLE == State && size >= 5)
+			{
+				memcpy(Header, bytes, 5);
+				DataLength = 0;
+				if (0xc0 == Header[1])
+				{
+					/* GET RESPONSE of the previous command */
+					Sw = 0x9000;
+					State = AnswerLength ? SIM_READY_DATA : SIM_READY_SW;
+					if (AnswerLength > Header[4] && Header[4])
+						AnswerLength = Header[4];
+				}
+				else if (SimCase3())
+				{
+					ExpectData = TRUE;
+					State = SIM_READY_DATA;
+				}
+				else
+				{
+					SimProcess();
+					State = (AnswerLength && 0x9000 == Sw)
+						? SIM_READY_DATA : SIM_READY_SW;
+				}
+				return size;
+			}
+			if (SIM_READY_DATA == State && ExpectData
+				&& size <= sizeof(Data))
+			{
+				memcpy(Data, bytes, size);
+				DataLength = size;
+				ExpectData = FALSE;
+				SimProcess();
+				/* the answer of a case 4 command is read by GET RESPONSE */
+				if (AnswerLength && 0x9000 == Sw)
+					Sw = 0x6100 | (AnswerLength & 0xFF);
+				State = SIM_READY_SW;
+				return size;
+			}
+			break;
+
+		case 0x6F:
+			if (SIM_READY_DATA == State)
+			{
+				n = min(size, AnswerLength);
+				memcpy(bytes, Answer, n);
+				State = SIM_READY_SW;
+				return n;
+			}
+			if (SIM_READY_SW == State && size >= 2)
+			{
+				bytes[0] = Sw >> 8;
+				bytes[1] = Sw;
+				State = SIM_IDLE;
+				return 2;
+			}
+			break;
+	}
+
+	errno = EIO;
+	return -1;
+} /* ControlUSB */
+
+
+/*****************************************************************************
+ *
+ *					get_device_descriptor
+ *
+ ****************************************************************************/
+_device_descriptor *get_device_descriptor(unsigned int reader_index)
+{
+	return &Readers[reader_index].desc;
+} /* get_device_descriptor */
+
+
+/*****************************************************************************
+ *
+ *					WakeUSB
+ *
+ *  nothing waits for the simulated token
+ ****************************************************************************/
+void WakeUSB(unsigned int reader_index)
+{
+	(void)reader_index;
+} /* WakeUSB */
+
+
+/*****************************************************************************
+ *
+ *					SimPlug
+ *
+ *  what OpenUSB() does for a real token
+ ****************************************************************************/
+void SimPlug(unsigned int reader_index)
+{
+	Readers[reader_index].poll_fd = -1;
+	Readers[reader_index].wake_fd[0] = -1;
+	Readers[reader_index].wake_fd[1] = -1;
+	Readers[reader_index].desc.dwMaxDevMessageLength = 261;
+	Readers[reader_index].desc.dwMaxIFSD = 254;
+	Readers[reader_index].desc.readTimeout =
+		Readers[reader_index].tuning.readTimeout;
+	Readers[reader_index].desc.busyBudget =
+		Readers[reader_index].tuning.busyBudget;
+
+	State = SIM_IDLE;
+	SimTransfers = 0;
+} /* SimPlug */
@@ -0,0 +1,36 @@
+/*
+    tokensim.h: simulated Rutoken S behind ControlUSB()
+    Copyright (C) 2012 Aktiv Co
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public License
+	along with this library; if not, write to the Free Software Foundation,
+	Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+
+#ifndef TOKENSIM_H
+#define TOKENSIM_H
+
+/* File identifier and size of the EF created in the MF */
+#define SIM_EF_FID	0x0001
+#define SIM_EF_SIZE	16
+
+/* USB transfers done since the token was plugged */
+extern long SimTransfers;
+
+void SimPlug(unsigned int reader_index);
+
+unsigned char SimEfByte(unsigned int offset);
+
+#endif